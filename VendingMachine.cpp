@@ -4,315 +4,1681 @@
 #include <vector>
 #include <iomanip>
 #include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <queue>
+#include <functional>
+#include <condition_variable>
+#include <stdexcept>
+#include <fstream>
+#include <charconv>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstdio>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <array>
+#include <atomic>
 
 using namespace std;
 
+struct Thb { // Thai baht, every other part of the cash handling is derived from a policy like this one
+    static constexpr const char* code = "thb";          // prefix of the note columns, thb_100
+    static constexpr const char* unit = "baht";
+    static constexpr const char* minor_unit = "satang"; // prices are kept in these, the column is price_satang
+    static constexpr int minor_per_unit = 100;
+    static constexpr array<int, 5> notes = {100, 20, 10, 5, 1}; // largest first
+};
+
+struct Usd {
+    static constexpr const char* code = "usd";
+    static constexpr const char* unit = "dollar";
+    static constexpr const char* minor_unit = "cent";
+    static constexpr int minor_per_unit = 100;
+    static constexpr array<int, 6> notes = {100, 50, 20, 10, 5, 1};
+};
+
+struct Eur {
+    static constexpr const char* code = "eur";
+    static constexpr const char* unit = "euro";
+    static constexpr const char* minor_unit = "cent";
+    static constexpr int minor_per_unit = 100;
+    static constexpr array<int, 6> notes = {50, 20, 10, 5, 2, 1};
+};
+
+#ifndef VENDING_CURRENCY
+#define VENDING_CURRENCY Thb // build with -DVENDING_CURRENCY=Eur (or Usd) for another currency
+#endif
+using Currency = VENDING_CURRENCY;
+constexpr int NOTE_COUNT = Currency::notes.size();
+constexpr int MINOR_PER_UNIT = Currency::minor_per_unit;
+constexpr int MAX_PRICE = 1000000;         // whole units, larger prices are refused on input so minor units fit an int
+constexpr int MAX_COUNT = 1000000;         // units of one item or notes of one kind accepted in one input
+constexpr int64_t MAX_PAYMENT = INT32_MAX; // minor units one sale may take, keeps the payment and the change in an int
+
+struct StockItem { // one item handed out by value, name points into the catalog and is valid until the catalog changes
+    int id = 0;
+    int price = 0; // satang
+    int amount = 0;
+    string_view name;
+};
+
+struct CashBox { // note counts in Currency::notes order, the loops below have a compile-time trip count and unroll
+    array<int, NOTE_COUNT> notes = {};
+
+    int& operator[](const int i) { return notes[i]; }
+    int operator[](const int i) const { return notes[i]; }
+    int64_t Total() const { // value of the box in whole units
+        int64_t total = 0;
+        for (int i = 0; i < NOTE_COUNT; i++) total += int64_t(notes[i]) * Currency::notes[i];
+        return total;
+    }
+    bool IsValid() const { // no negative counts
+        for (int i = 0; i < NOTE_COUNT; i++) {
+            if (notes[i] < 0) return false;
+        }
+        return true;
+    }
+    CashBox& operator+=(const CashBox& other) {
+        for (int i = 0; i < NOTE_COUNT; i++) notes[i] += other.notes[i];
+        return *this;
+    }
+    CashBox operator-() const {
+        CashBox negated;
+        for (int i = 0; i < NOTE_COUNT; i++) negated.notes[i] = -notes[i];
+        return negated;
+    }
+};
+
+class Catalog { // the stock table in memory as struct-of-arrays, a scan over one field only reads that field's array
+private:
+    vector<int> ids;
+    vector<int> prices; // minor units (satang for baht)
+    vector<int> amounts;
+    vector<string> names;
+    vector<char> dirty; // changed in memory but not yet flushed to sqlite
+    unordered_map<int, int> id_index;      // item id -> position
+    unordered_map<string, int> name_index; // item name -> position
+
+public:
+    int Size() const { return ids.size(); }
+    void Clear() {
+        ids.clear();
+        prices.clear();
+        amounts.clear();
+        names.clear();
+        dirty.clear();
+        id_index.clear();
+        name_index.clear();
+    }
+    void Reserve(const int count) {
+        ids.reserve(count);
+        prices.reserve(count);
+        amounts.reserve(count);
+        names.reserve(count);
+        dirty.reserve(count);
+        id_index.reserve(count);
+        name_index.reserve(count);
+    }
+    int Add(const int id, const string& name, const int price, const int amount) { // append a loaded item, returns its position
+        id_index[id] = ids.size();
+        name_index[name] = ids.size();
+        ids.push_back(id);
+        names.push_back(name);
+        prices.push_back(price);
+        amounts.push_back(amount);
+        dirty.push_back(0);
+        return ids.size() - 1;
+    }
+    pair<int, bool> FindOrAdd(const string& name, const int new_id) { // position of the item with this name, adding an empty one (and true) if there is none
+        auto [it, is_new] = name_index.try_emplace(name, ids.size());
+        if (is_new) {
+            id_index[new_id] = ids.size();
+            ids.push_back(new_id);
+            names.push_back(name);
+            prices.push_back(0);
+            amounts.push_back(0);
+            dirty.push_back(0);
+        }
+        return {it->second, is_new};
+    }
+    int Find(const int id) const { // position of the item, -1 if there is none
+        auto it = id_index.find(id);
+        return it == id_index.end() ? -1 : it->second;
+    }
+    StockItem Get(const int index) const { return {ids[index], prices[index], amounts[index], names[index]}; }
+    int Id(const int index) const { return ids[index]; }
+    int Price(const int index) const { return prices[index]; }
+    int Amount(const int index) const { return amounts[index]; }
+    const string& Name(const int index) const { return names[index]; }
+    void SetPrice(const int index, const int price) { prices[index] = price; }
+    void SetAmount(const int index, const int amount) { amounts[index] = amount; }
+    bool MarkDirty(const int index) { // true the first time since the last flush
+        if (dirty[index]) return false;
+        dirty[index] = 1;
+        return true;
+    }
+    void ClearDirty(const int index) { dirty[index] = 0; }
+    int CountOutOfStock() const { // columnar scan over the amounts only
+        return count_if(amounts.begin(), amounts.end(), [](int amount) { return amount <= 0; });
+    }
+};
+
+struct RestockEntry { // one line of a (bulk) restock
+    string name;
+    int price = 0; // satang
+    int amount = 0;
+};
+
+enum JournalType { JOURNAL_SALE = 1, JOURNAL_RESTOCK, JOURNAL_REFILL, JOURNAL_COLLECT, JOURNAL_SET_CHANGE_BOX, JOURNAL_SET_COLLECTION_BOX };
+
+struct JournalRecord { // fixed part of one journal entry, a restock is followed by name_length bytes of item name
+    uint64_t sequence = 0;
+    int64_t time = 0;        // microseconds since the epoch
+    int32_t type = 0;
+    int32_t item_id = 0;
+    int32_t price = 0;         // satang
+    int32_t amount = 0;
+    int32_t notes_in[NOTE_COUNT] = {};  // sale: inserted notes, refill / set box: the notes
+    int32_t notes_out[NOTE_COUNT] = {}; // sale: change given, collect: notes taken out
+    int32_t name_length = 0;
+};
+
+enum SaleResult { SOLD, NO_SUCH_ITEM, OUT_OF_STOCK, NOT_ENOUGH_PAYMENT, NO_CHANGE, INVALID_NOTE, NO_ITEM_SELECTED };
+
+struct MachineConfig {
+    string database = "VendingMachineDatabase.db"; // several machines may share one database file
+    string machine_name = "";       // prefix of this machine's tables, empty uses the original table names
+    int flush_interval = 5;         // seconds between write-back flushes, 0 writes every change through immediately
+    int sales_per_commit = 1;       // sales (and admin operations) grouped into one BEGIN/COMMIT, 1 commits each sale
+    string journal_mode = "WAL";    // sqlite journal_mode pragma: DELETE, TRUNCATE, PERSIST, MEMORY, WAL or OFF
+    string synchronous = "NORMAL";  // sqlite synchronous pragma: OFF, NORMAL, FULL or EXTRA, FULL and EXTRA also fsync the journal
+    bool journal = true;            // keep <database>[.<machine>].journal and .snapshot next to an on-disk database
+    int snapshot_every = 100000;    // journal records between snapshots, bounds the replay on startup
+    bool background_flush = false;  // a unit of work only writes the journal, the owner calls FlushIfDue off the customer's path
+    int max_collection = 100;       // notes of one kind the collection box holds before the machine stops selling
+    int min_change = 1;             // notes of each kind the change box must keep for the machine to sell
+    int history_days = 28;          // days of sales history the planner forecasts from
+    int plan_horizon_days = 7;      // days until the next visit, the planner stocks the machine to last that long
+};
+
+struct ItemPlan { // forecast for one item
+    int id = 0;
+    string name;
+    int amount = 0;
+    double sold_per_day = 0;
+    double days_left = -1; // until it sells out, -1 if it has not sold
+    int restock = 0;       // units to add so it lasts the horizon
+};
+
+struct MachinePlan { // what to bring to one machine on the next visit
+    string machine;
+    int days_observed = 0;            // days of history the rates are based on
+    vector<ItemPlan> items;           // items that run out within the horizon, soonest first
+    array<double, NOTE_COUNT> change_per_day = {}; // notes paid out as change, largest note first
+    CashBox change_refill;            // notes to add to the change box so it lasts the horizon
+    double days_to_collection = -1;   // until some note of the collection box reaches max_collection, -1 if nothing is paid in
+};
+
+class ChangeMaker { // minimum-note change out of a limited stock of notes (bounded knapsack), for the notes of Currency
+private:
+    static constexpr const array<int, NOTE_COUNT>& bank_note = Currency::notes;
+    vector<pair<int, int>> parts;  // (note index, notes) after splitting each note's stock into 1, 2, 4, ... bundles
+    vector<int> min_notes;         // min_notes[a] = fewest notes that pay exactly a, INF if impossible
+    vector<char> take;             // take[part * (amount + 1) + a] = part was used for a
+    CashBox cached_box;            // the box the tables were built for
+    int cached_amount = -1;        // largest amount the tables cover
+    static constexpr int INF = 1 << 29;
+    static constexpr size_t MAX_TABLE_BYTES = 1 << 22; // take grows with parts * amount, change that needs more is refused
+
+    bool Build(const CashBox& box, const int amount) { // fill the tables for every amount up to amount, false if they would be too large
+        parts.clear();
+        for (int i = 0; i < bank_note.size(); i++) {
+            int left = box[i];
+            for (int k = 1; left > 0; k *= 2) { // any count 0..box[i] is a sum of these bundles
+                int notes = min(k, left);
+                if (notes * bank_note[i] > amount) break;
+                parts.push_back({i, notes});
+                left -= notes;
+            }
+        }
+        if (parts.size() * (size_t(amount) + 1) > MAX_TABLE_BYTES) return false; // the cached tables stay as they were
+
+        min_notes.assign(amount + 1, INF);
+        min_notes[0] = 0;
+        take.assign(parts.size() * (amount + 1), 0);
+        for (int p = 0; p < parts.size(); p++) {
+            const int weight = parts[p].second * bank_note[parts[p].first];
+            char* took = &take[p * (amount + 1)];
+            for (int a = amount; a >= weight; a--) {
+                if (min_notes[a - weight] + parts[p].second < min_notes[a]) {
+                    min_notes[a] = min_notes[a - weight] + parts[p].second;
+                    took[a] = 1;
+                }
+            }
+        }
+        cached_box = box;
+        cached_amount = amount;
+        return true;
+    }
+
+public:
+    bool MakeChange(const int amount, const CashBox& box, CashBox& change_given) { // fewest notes for amount using at most box[i] of each, false if it cannot be paid
+        change_given = CashBox();
+        if (amount < 0) return false;
+        if (amount == 0) return true;
+        if (amount > box.Total()) return false; // not even emptying the box would do, no need for the tables
+
+        if (cached_amount < 0 || box.notes != cached_box.notes || amount > cached_amount) {
+            if (!Build(box, amount)) return false;
+        }
+        if (min_notes[amount] >= INF) return false;
+
+        int a = amount;
+        for (int p = parts.size() - 1; p >= 0 && a > 0; p--) { // walk the choices back from the last part
+            if (take[p * (cached_amount + 1) + a]) {
+                change_given[parts[p].first] += parts[p].second;
+                a -= parts[p].second * bank_note[parts[p].first];
+            }
+        }
+        return true;
+    }
+};
+
+enum MetricSlot { // what Metrics counts, the sql statements follow METRIC_SQL in Query order
+    METRIC_GIVE_CHANGE, METRIC_BUY_ITEM, METRIC_SELL_ITEM, METRIC_SET_CHANGE_BOX, METRIC_RESTOCK_ITEM,
+    METRIC_EMPTY_COLLECTION, METRIC_READINESS, METRIC_FLUSH, METRIC_JOURNAL_WRITE,
+    METRIC_SQL,
+    METRIC_SLOT_COUNT = METRIC_SQL + 32
+};
+
+class Metrics { // process-wide call counts, error counts and latency histograms, each thread only writes its own shard
+public:
+    static constexpr int BUCKET_COUNT = 40;   // bucket b holds calls that took less than 2^b ns (and at least 2^(b-1))
+    static constexpr int HOT_SAMPLE_EVERY = 16; // reading the clock costs more than the hot paths themselves, time only every 16th call
+
+private:
+    struct Shard { // written by one thread without locked instructions, read by Write* under shards_lock
+        atomic<uint64_t> calls[METRIC_SLOT_COUNT] = {};
+        atomic<uint64_t> errors[METRIC_SLOT_COUNT] = {};
+        atomic<uint64_t> samples[METRIC_SLOT_COUNT] = {}; // timed calls, the histogram and total_ns cover only these
+        atomic<uint64_t> total_ns[METRIC_SLOT_COUNT] = {};
+        atomic<uint64_t> buckets[METRIC_SLOT_COUNT][BUCKET_COUNT] = {};
+    };
+    struct Totals {
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        uint64_t samples = 0;
+        uint64_t total_ns = 0;
+        uint64_t buckets[BUCKET_COUNT] = {};
+    };
+
+    mutable mutex shards_lock;
+    vector<unique_ptr<Shard>> shards; // one per thread recording at the same time, their counts outlive the thread
+    vector<Shard*> free_shards;       // shards of exited threads, the next new thread continues on one of them
+    const char* slot_names[METRIC_SLOT_COUNT] = {
+        "give_change", "buy_item", "sell_item", "set_change_box", "restock_item",
+        "empty_collection", "readiness", "flush", "journal_write"
+    };
+
+    static void Add(atomic<uint64_t>& counter, const uint64_t value) { // single writer, a relaxed load and store is enough
+        counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+    }
+    struct Lease { // a thread's hold on its shard, handed back when the thread exits so short-lived threads do not pile up shards
+        Metrics* owner = nullptr;
+        Shard* shard = nullptr;
+        ~Lease() {
+            if (shard == nullptr) return;
+            lock_guard<mutex> lock(owner->shards_lock);
+            owner->free_shards.push_back(shard);
+        }
+    };
+    Shard& Local() {
+        thread_local Lease lease;
+        if (lease.shard == nullptr) {
+            lock_guard<mutex> lock(shards_lock);
+            if (free_shards.empty()) {
+                shards.push_back(make_unique<Shard>());
+                free_shards.push_back(shards.back().get());
+            }
+            lease.owner = this;
+            lease.shard = free_shards.back();
+            free_shards.pop_back();
+        }
+        return *lease.shard;
+    }
+    Totals Sum(const int slot) const { // caller holds shards_lock
+        Totals totals;
+        for (const unique_ptr<Shard>& shard : shards) {
+            totals.calls += shard->calls[slot].load(memory_order_relaxed);
+            totals.errors += shard->errors[slot].load(memory_order_relaxed);
+            totals.samples += shard->samples[slot].load(memory_order_relaxed);
+            totals.total_ns += shard->total_ns[slot].load(memory_order_relaxed);
+            for (int b = 0; b < BUCKET_COUNT; b++) totals.buckets[b] += shard->buckets[slot][b].load(memory_order_relaxed);
+        }
+        return totals;
+    }
+    static uint64_t Quantile(const Totals& totals, const double q) { // upper bound in ns of the bucket holding the q-th timed call
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKET_COUNT; b++) {
+            seen += totals.buckets[b];
+            if (seen > 0 && seen >= q * totals.samples) return 1ULL << b;
+        }
+        return 1ULL << (BUCKET_COUNT - 1);
+    }
+    static const char* Family(const int slot) { return slot < METRIC_SQL ? "vending_operation" : "vending_sql"; }
+    static const char* Label(const int slot) { return slot < METRIC_SQL ? "operation" : "statement"; }
+
+public:
+    class Timer { // counts one call under a slot and, for every sample_every-th call, records how long it took
+    private:
+        Shard& shard;
+        int slot;
+        bool is_timed;
+        chrono::steady_clock::time_point start;
+
+    public:
+        explicit Timer(const int metric_slot, const uint64_t sample_every = 1) : shard(Global().Local()), slot(metric_slot) { // sample_every must be a power of two
+            const uint64_t calls = shard.calls[slot].load(memory_order_relaxed);
+            is_timed = (calls & (sample_every - 1)) == 0;
+            Add(shard.calls[slot], 1);
+            if (is_timed) start = chrono::steady_clock::now();
+        }
+        ~Timer() {
+            if (!is_timed) return;
+            const uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            Add(shard.samples[slot], 1);
+            Add(shard.total_ns[slot], ns);
+            Add(shard.buckets[slot][min(BUCKET_COUNT - 1, 64 - __builtin_clzll(ns | 1))], 1);
+        }
+    };
+
+    static Metrics& Global() {
+        static Metrics metrics;
+        return metrics;
+    }
+    void NameSlot(const int slot, const char* name) { slot_names[slot] = name; } // only while setting up, before any thread records
+    void CountError(const int slot) { Add(Local().errors[slot], 1); }
+    void WritePrometheus(ostream& out) const { // text exposition format, slots that were never used are left out
+        lock_guard<mutex> lock(shards_lock);
+        for (const char* family : {"vending_operation", "vending_sql"}) {
+            out << "# TYPE " << family << "_errors_total counter\n";
+            for (int slot = 0; slot < METRIC_SLOT_COUNT; slot++) {
+                if (slot_names[slot] == nullptr || strcmp(Family(slot), family) != 0) continue;
+                const Totals totals = Sum(slot);
+                if (totals.calls > 0 || totals.errors > 0) out << family << "_errors_total{" << Label(slot) << "=\"" << slot_names[slot] << "\"} " << totals.errors << '\n';
+            }
+            out << "# TYPE " << family << "_calls_total counter\n";
+            for (int slot = 0; slot < METRIC_SLOT_COUNT; slot++) {
+                if (slot_names[slot] == nullptr || strcmp(Family(slot), family) != 0) continue;
+                const Totals totals = Sum(slot);
+                if (totals.calls > 0) out << family << "_calls_total{" << Label(slot) << "=\"" << slot_names[slot] << "\"} " << totals.calls << '\n';
+            }
+            out << "# TYPE " << family << "_seconds histogram\n"; // hot operations are sampled, the histogram counts only timed calls
+            for (int slot = 0; slot < METRIC_SLOT_COUNT; slot++) {
+                if (slot_names[slot] == nullptr || strcmp(Family(slot), family) != 0) continue;
+                const Totals totals = Sum(slot);
+                if (totals.samples == 0) continue;
+
+                const string label = string(Label(slot)) + "=\"" + slot_names[slot] + "\"";
+                int first = 0, last = BUCKET_COUNT - 1; // empty buckets at either end add nothing
+                while (first < last && totals.buckets[first] == 0) first++;
+                while (last > first && totals.buckets[last] == 0) last--;
+                uint64_t cumulative = 0;
+                for (int b = first; b <= last; b++) {
+                    cumulative += totals.buckets[b];
+                    out << family << "_seconds_bucket{" << label << ",le=\"" << (1ULL << b) * 1e-9 << "\"} " << cumulative << '\n';
+                }
+                out << family << "_seconds_bucket{" << label << ",le=\"+Inf\"} " << totals.samples << '\n';
+                out << family << "_seconds_sum{" << label << "} " << totals.total_ns * 1e-9 << '\n';
+                out << family << "_seconds_count{" << label << "} " << totals.samples << '\n';
+            }
+        }
+    }
+    void WriteJson(ostream& out) const { // one line, {"operation": {"calls": n, "errors": n, "mean_ns": x, "p50_ns": x, "p99_ns": x}, ...}
+        lock_guard<mutex> lock(shards_lock);
+        bool is_first = true;
+        out << '{';
+        for (int slot = 0; slot < METRIC_SLOT_COUNT; slot++) {
+            if (slot_names[slot] == nullptr) continue;
+            const Totals totals = Sum(slot);
+            if (totals.calls == 0 && totals.errors == 0) continue;
+
+            out << (is_first ? "" : ", ") << '"' << (slot < METRIC_SQL ? "" : "sql_") << slot_names[slot] << "\": {\"calls\": " << totals.calls
+                << ", \"errors\": " << totals.errors << ", \"mean_ns\": " << (totals.samples > 0 ? totals.total_ns / totals.samples : 0)
+                << ", \"p50_ns\": " << Quantile(totals, 0.5) << ", \"p99_ns\": " << Quantile(totals, 0.99) << '}';
+            is_first = false;
+        }
+        out << '}';
+    }
+};
+
 class VendingMachine {
+    friend class Benchmark; // times the private hot paths directly
 private:
-    sqlite3* db;
+    enum Query { // every statement the machine runs, prepared once in the constructor
+        SELECT_ALL_STOCK, UPSERT_STOCK,
+        COUNT_CHANGE_BOX, SELECT_CHANGE_BOX, INSERT_CHANGE_BOX, SAVE_CHANGE_BOX,
+        COUNT_COLLECTION_BOX, SELECT_COLLECTION_BOX, INSERT_COLLECTION_BOX, SAVE_COLLECTION_BOX,
+        SELECT_JOURNAL_STATE, SAVE_JOURNAL_STATE,
+        UPSERT_SALES_HISTORY, UPSERT_CHANGE_HISTORY, SELECT_SALES_HISTORY, SELECT_CHANGE_HISTORY,
+        BEGIN_TRANSACTION, COMMIT_TRANSACTION, ROLLBACK_TRANSACTION,
+        QUERY_COUNT
+    };
+    static constexpr const char* query_names[QUERY_COUNT] = { // labels of the per-statement metrics
+        "select_all_stock", "upsert_stock",
+        "count_change_box", "select_change_box", "insert_change_box", "save_change_box",
+        "count_collection_box", "select_collection_box", "insert_collection_box", "save_collection_box",
+        "select_journal_state", "save_journal_state",
+        "upsert_sales_history", "upsert_change_history", "select_sales_history", "select_change_history",
+        "begin_transaction", "commit_transaction", "rollback_transaction"
+    };
+    static_assert(METRIC_SQL + QUERY_COUNT <= METRIC_SLOT_COUNT, "not enough metric slots for every statement");
+
+    sqlite3* db = nullptr;
     char* err_msg = nullptr;
     int rc;
-    int max_collection = 100;
-    const vector<int> bank_note = {100, 20, 10, 5, 1};
+    static constexpr const array<int, NOTE_COUNT>& bank_note = Currency::notes;
+    const string price_column = string("price_") + Currency::minor_unit;
+    sqlite3_stmt* statements[QUERY_COUNT] = {};
+    MachineConfig config;
+    string stock_table = "stocks_67011140";
+    string change_box_table = "change_box";
+    string collection_box_table = "collection_box";
+    string journal_state_table = "journal_state";
+    string sales_history_table = "sales_history";
+    string change_history_table = "change_history";
+    ChangeMaker change_maker;
+
+    // in-memory copy of the database, loaded once in the constructor and written back by Flush()
+    Catalog stock;
+    vector<int> dirty_items;             // positions in stock waiting to be flushed
+    CashBox change_box;                  // note counts, largest note first
+    CashBox collection_box;
+    bool change_box_dirty = false;
+    bool collection_box_dirty = false;
+    int next_item_id = 1;
+    int pending_sales = 0; // units of work applied in memory since the last flush
+    int page_size = 50;    // stock rows per page in the admin item view
+    string table_buffer;   // PrintTable renders into this and writes it out once, reused between calls
+
+    // sales history for the planner, summed per day in memory and added to sqlite by Flush()
+    struct DayHistory { // zeroed after a flush and reused, so recording a sale allocates nothing once the slot exists
+        int day = 0;                  // since the epoch, utc
+        bool is_pending = false;      // holds sales not yet flushed
+        vector<int> sold;             // position in stock -> units, grows with the catalog
+        vector<int> sold_items;       // positions with units in sold, like dirty_items
+        CashBox paid;                 // notes put in by customers
+        CashBox change;               // notes paid out as change
+    };
+    vector<DayHistory> pending_history;   // usually one slot, a second while a flush group spans midnight
+    uint64_t history_sequence = 0;        // replayed sales up to here are already in the history tables
+
+    // journal and snapshot files, see OpenJournal()
+    static constexpr size_t JOURNAL_BUFFER_SIZE = 1 << 16;
+    static constexpr uint64_t SNAPSHOT_MAGIC = 0x33504e5353474d56; // "VMGSSNP3", followed by the CurrencyTag
+    static constexpr uint64_t JOURNAL_MAGIC = 0x31524e4a53474d56;  // "VMGSJNR1", followed by the CurrencyTag, then the records
+    struct CurrencyTag { // which build wrote a snapshot or journal, the box and record layouts depend on it
+        char code[8] = {};
+        int32_t note_count = NOTE_COUNT;
+        int32_t record_size = sizeof(JournalRecord);
+
+        CurrencyTag() { strncpy(code, Currency::code, sizeof(code) - 1); }
+        bool operator==(const CurrencyTag& other) const {
+            return memcmp(code, other.code, sizeof(code)) == 0 && note_count == other.note_count && record_size == other.record_size;
+        }
+        string Describe() const { return string(code, strnlen(code, sizeof(code))) + ", " + to_string(note_count) + " notes"; }
+    };
+    string journal_path;
+    string snapshot_path;
+    int journal_fd = -1;
+    off_t journal_end = -1;              // bytes of the journal ReplayJournal could parse, anything after it is a torn write
+    vector<char> journal_buffer;
+    uint64_t journal_sequence = 0;   // last record appended, or replayed on startup
+    uint64_t records_since_snapshot = 0;
+    bool is_replaying = false;       // replayed records are not journaled again
+
+    // readiness, kept up to date by every mutation so the checks before a sale are O(1)
+    int out_of_stock_count = 0;       // items with amount <= 0
+    bool is_change_box_empty = true;  // some note in the change box ran out
+    bool is_collection_full = false;  // some note in the collection box reached max_collection
+    chrono::steady_clock::time_point last_flush;
 
+    static string NoteColumn(const int i, const string& kind = "") { // thb_100, or paid_thb_100 with a kind
+        return (kind.empty() ? "" : kind + "_") + Currency::code + "_" + to_string(bank_note[i]);
+    }
+    bool HasTable(const string& table_name) {
+        sqlite3_stmt* stmt = nullptr;
+        bool found = false;
+
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;", -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, table_name.c_str(), -1, SQLITE_STATIC);
+            found = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+        sqlite3_finalize(stmt);
+        return found;
+    }
+    bool HasColumn(const string& table_name, const string& column_name) {
+        sqlite3_stmt* stmt = nullptr;
+        bool found = false;
+
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info(?) WHERE name = ?;", -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, table_name.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, column_name.c_str(), -1, SQLITE_STATIC);
+            found = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+        sqlite3_finalize(stmt);
+        return found;
+    }
+    [[noreturn]] void Fail(const string& reason) { // release the connection and give up, the constructor never finishes so the destructor will not run
+        for (sqlite3_stmt*& stmt : statements) {
+            sqlite3_finalize(stmt);
+            stmt = nullptr;
+        }
+        sqlite3_close(db);
+        db = nullptr;
+        throw runtime_error(reason);
+    }
     void CreateDatabase() { // create or open an existing database; then make a table for stocks and payment
         // create / open a database
-        rc = sqlite3_open("VendingMachineDatabase.db", &db);
-        if (rc) cerr << "Cannot open database" << endl;
+        rc = sqlite3_open(config.database.c_str(), &db);
+        if (rc) Fail("cannot open database " + config.database + ": " + sqlite3_errmsg(db));
+        sqlite3_busy_timeout(db, 5000); // other machines in the fleet write to the same file, wait for their commit
+        CheckCurrency();
+
+        // journaling, WAL lets a commit append to the log instead of rewriting pages
+        string pragmas = "PRAGMA journal_mode = " + config.journal_mode + "; PRAGMA synchronous = " + config.synchronous + ";";
+        rc = sqlite3_exec(db, pragmas.c_str(), nullptr, nullptr, &err_msg);
+        if (rc != SQLITE_OK) {
+            cerr << "SQL error: " << err_msg << endl; 
+            sqlite3_free(err_msg);
+        }
 
         // create stock table
-        const char* stock_table = R"(
-            CREATE TABLE IF NOT EXISTS stocks_67011140 (
+        const string stock_columns = R"( (
                 id INTEGER PRIMARY KEY AUTOINCREMENT,
                 name TEXT NOT NULL,
-                price TEXT NOT NULL,
-                amount INTEGER
+                )" + price_column + R"( INTEGER NOT NULL,
+                amount INTEGER,
+                out_of_stock INTEGER NOT NULL DEFAULT 0
             );
         )";
-        rc = sqlite3_exec(db, stock_table, nullptr, nullptr, &err_msg);
+        string stock_table_sql = "CREATE TABLE IF NOT EXISTS " + stock_table + stock_columns;
+        rc = sqlite3_exec(db, stock_table_sql.c_str(), nullptr, nullptr, &err_msg);
         if (rc != SQLITE_OK) {
             cerr << "SQL error: " << err_msg << endl; 
             sqlite3_free(err_msg);
         }
 
-        // create change box table, this table will only use one element
-        const char* change_box_table = R"(
-            CREATE TABLE IF NOT EXISTS change_box (
-                id INTEGER PRIMARY KEY AUTOINCREMENT,
-                thb_100 INTEGER,
-                thb_20 INTEGER,
-                thb_10 INTEGER,
-                thb_5 INTEGER,
-                thb_1 INTEGER
-            ); 
-        )"; 
-        rc = sqlite3_exec(db, change_box_table, nullptr, nullptr, &err_msg);
+        // older tables kept the price as whole-unit TEXT and marked sold out items by overwriting it, rebuild them
+        if (HasColumn(stock_table, "price")) {
+            string out_of_stock = HasColumn(stock_table, "out_of_stock") ? "out_of_stock" : "(amount <= 0 OR price = 'OUT OF STOCK')";
+            string migrate_sql = "BEGIN; "
+                "CREATE TABLE " + stock_table + "_new" + stock_columns +
+                "INSERT INTO " + stock_table + "_new (id, name, " + price_column + ", amount, out_of_stock) "
+                "SELECT id, name, CAST(price AS INTEGER) * " + to_string(MINOR_PER_UNIT) + ", amount, " + out_of_stock + " FROM " + stock_table + "; "
+                "DROP TABLE " + stock_table + "; "
+                "ALTER TABLE " + stock_table + "_new RENAME TO " + stock_table + "; "
+                "COMMIT;";
+            rc = sqlite3_exec(db, migrate_sql.c_str(), nullptr, nullptr, &err_msg);
+            if (rc != SQLITE_OK) {
+                cerr << "SQL error: " << err_msg << endl; 
+                sqlite3_free(err_msg);
+                sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            }
+        }
+
+        // item names are unique, restock finds its row by name
+        string name_index_sql = "CREATE UNIQUE INDEX IF NOT EXISTS " + stock_table + "_name ON " + stock_table + " (name);";
+        rc = sqlite3_exec(db, name_index_sql.c_str(), nullptr, nullptr, &err_msg);
         if (rc != SQLITE_OK) {
             cerr << "SQL error: " << err_msg << endl; 
             sqlite3_free(err_msg);
         }
 
-        // create collection box table, this table will only use one element
-        const char* collection_box_table = R"(
-            CREATE TABLE IF NOT EXISTS collection_box (
-                id INTEGER PRIMARY KEY AUTOINCREMENT,
-                thb_100 INTEGER,
-                thb_20 INTEGER,
-                thb_10 INTEGER,
-                thb_5 INTEGER,
-                thb_1 INTEGER
-            );
-        )";
-        rc = sqlite3_exec(db, collection_box_table, nullptr, nullptr, &err_msg);
+        // the last journal record that has reached these tables, this table will only use one element
+        string journal_state_sql = "CREATE TABLE IF NOT EXISTS " + journal_state_table + " (id INTEGER PRIMARY KEY, sequence INTEGER NOT NULL);";
+        rc = sqlite3_exec(db, journal_state_sql.c_str(), nullptr, nullptr, &err_msg);
         if (rc != SQLITE_OK) {
             cerr << "SQL error: " << err_msg << endl; 
             sqlite3_free(err_msg);
         }
-    }
-    int GetRowCount(const string& table_name) { // return the amount of row in the table, 0 if nothing in table
-        string query = "SELECT COUNT(*) FROM " + table_name + ";";
-        int row_count = 0;
 
-        // callback function
-        auto RowCountCallback = [](void* data, int argc, char** argv, char** az_col_name) -> int {
-            int* row_count_ptr = static_cast<int*>(data);
-            if (argc > 0 && argv[0]) *row_count_ptr = stoi(argv[0]);
-            return 0;
-        };
-        rc = sqlite3_exec(db, query.c_str(), RowCountCallback, &row_count, &err_msg);
+        // units sold per item and day, and notes paid in and out per day, the planner forecasts from these
+        string history_sql = "CREATE TABLE IF NOT EXISTS " + sales_history_table +
+            " (day INTEGER NOT NULL, item_id INTEGER NOT NULL, sold INTEGER NOT NULL, PRIMARY KEY (day, item_id)) WITHOUT ROWID;"
+            "CREATE TABLE IF NOT EXISTS " + change_history_table + " (day INTEGER PRIMARY KEY";
+        for (const char* kind : {"paid", "change"}) {
+            for (int i = 0; i < NOTE_COUNT; i++) history_sql += ", " + NoteColumn(i, kind) + " INTEGER NOT NULL";
+        }
+        history_sql += ");";
+        rc = sqlite3_exec(db, history_sql.c_str(), nullptr, nullptr, &err_msg);
         if (rc != SQLITE_OK) {
             cerr << "SQL error: " << err_msg << endl; 
             sqlite3_free(err_msg);
         }
 
-        return row_count;
+        // create change box table and collection box table, these tables will only use one element
+        for (const string& box_table : {change_box_table, collection_box_table}) {
+            string box_table_sql = "CREATE TABLE IF NOT EXISTS " + box_table + " (id INTEGER PRIMARY KEY AUTOINCREMENT";
+            for (int i = 0; i < NOTE_COUNT; i++) box_table_sql += ", " + NoteColumn(i) + " INTEGER";
+            box_table_sql += ");";
+            rc = sqlite3_exec(db, box_table_sql.c_str(), nullptr, nullptr, &err_msg);
+            if (rc != SQLITE_OK) {
+                cerr << "SQL error: " << err_msg << endl; 
+                sqlite3_free(err_msg);
+            }
+        }
     }
-    vector<string> GetRowValue(const string table_name, const string condition) {
-        vector<string> row_value;
-        string query = "SELECT * FROM " + table_name + " WHERE " + condition + ";";
-
-        auto callback = [](void* data, int argc, char** argv, char** az_col_name) -> int {
-            auto* row_value_ptr = static_cast<vector<string>*>(data);
-            for (int i = 0; i < argc; i++) {
-                row_value_ptr->push_back(argv[i] ? argv[i] : "NULL");
+    void CheckCurrency() { // tables made by a build for another currency have other note and price columns, refuse them before anything changes the file
+        if (HasTable(stock_table) && !HasColumn(stock_table, price_column) && !HasColumn(stock_table, "price")) { // price is the pre-satang column, migrated later
+            Fail(config.database + " was not created for " + Currency::code + " notes: " + stock_table + " has no column " + price_column);
+        }
+        vector<pair<string, string>> expected;
+        for (int i = 0; i < NOTE_COUNT; i++) {
+            expected.push_back({change_box_table, NoteColumn(i)});
+            expected.push_back({collection_box_table, NoteColumn(i)});
+            expected.push_back({change_history_table, NoteColumn(i, "paid")});
+        }
+        for (const auto& [table, column] : expected) {
+            if (HasTable(table) && !HasColumn(table, column)) {
+                Fail(config.database + " was not created for " + Currency::code + " notes: " + table + " has no column " + column);
             }
-            return 0;
-        };
-        rc = sqlite3_exec(db, query.c_str(), callback, &row_value, &err_msg);
-        if (rc != SQLITE_OK) {
-            cerr << "SQL error: " << err_msg << endl; 
-            sqlite3_free(err_msg);
         }
-
-        return row_value;
     }
-    vector<string> GetColumnValue(const string table_name, const string column_name) {
-        vector<string> column_value;
-        string query = "SELECT " + column_name + " FROM " + table_name + ";";
-
-        auto callback = [](void* data, int argc, char** argv, char** az_col_name) -> int {
-            auto* col_value_ptr = static_cast<vector<string>*>(data);
-            if (argc > 0 && argv[0]) {
-                col_value_ptr -> push_back(argv[0]);
+    void PrepareStatements() { // compile every query once, later calls only bind parameters and step
+        string box_columns, box_zeros, box_update;
+        for (int i = 0; i < NOTE_COUNT; i++) {
+            box_columns += (i ? ", " : "") + NoteColumn(i);
+            box_zeros += i ? ", 0" : "0";
+            box_update += (i ? ", " : "") + NoteColumn(i) + " = ?";
+        }
+        string history_columns, history_values, history_update, history_sums;
+        for (const char* kind : {"paid", "change"}) {
+            for (int i = 0; i < NOTE_COUNT; i++) {
+                const string column = NoteColumn(i, kind);
+                history_columns += ", " + column;
+                history_values += ", ?";
+                history_update += (history_update.empty() ? "" : ", ") + column + " = " + column + " + excluded." + column;
+                history_sums += ", SUM(" + column + ")";
             }
-            return 0;
+        }
+        const string sql[QUERY_COUNT] = {
+            "SELECT id, name, " + price_column + ", amount FROM " + stock_table + " ORDER BY id;",
+            "INSERT INTO " + stock_table + " (id, name, " + price_column + ", amount, out_of_stock) VALUES (?, ?, ?, ?, ?) "
+            "ON CONFLICT(id) DO UPDATE SET name = excluded.name, " + price_column + " = excluded." + price_column + ", amount = excluded.amount, out_of_stock = excluded.out_of_stock;",
+            "SELECT COUNT(*) FROM " + change_box_table + ";",
+            "SELECT " + box_columns + " FROM " + change_box_table + " WHERE id = 1;",
+            "INSERT INTO " + change_box_table + " (" + box_columns + ") VALUES (" + box_zeros + ");",
+            "UPDATE " + change_box_table + " SET " + box_update + " WHERE id = 1;",
+            "SELECT COUNT(*) FROM " + collection_box_table + ";",
+            "SELECT " + box_columns + " FROM " + collection_box_table + " WHERE id = 1;",
+            "INSERT INTO " + collection_box_table + " (" + box_columns + ") VALUES (" + box_zeros + ");",
+            "UPDATE " + collection_box_table + " SET " + box_update + " WHERE id = 1;",
+            "SELECT sequence FROM " + journal_state_table + " WHERE id = 1;",
+            "INSERT OR REPLACE INTO " + journal_state_table + " (id, sequence) VALUES (1, ?);",
+            "INSERT INTO " + sales_history_table + " (day, item_id, sold) VALUES (?, ?, ?) "
+            "ON CONFLICT(day, item_id) DO UPDATE SET sold = sold + excluded.sold;",
+            "INSERT INTO " + change_history_table + " (day" + history_columns + ") VALUES (?" + history_values + ") "
+            "ON CONFLICT(day) DO UPDATE SET " + history_update + ";",
+            "SELECT item_id, SUM(sold) FROM " + sales_history_table + " WHERE day >= ? GROUP BY item_id;",
+            "SELECT MIN(day)" + history_sums + " FROM " + change_history_table + " WHERE day >= ?;",
+            "BEGIN IMMEDIATE;", // take the write lock up front so a busy fleet waits instead of failing mid-flush
+            "COMMIT;",
+            "ROLLBACK;"
         };
-        rc = sqlite3_exec(db, query.c_str(), callback, &column_value, &err_msg);
-        if (rc != SQLITE_OK) {
-            cerr << "SQL error: " << err_msg << endl; 
-            sqlite3_free(err_msg);
+        for (int i = 0; i < QUERY_COUNT; i++) {
+            Metrics::Global().NameSlot(METRIC_SQL + i, query_names[i]);
+            rc = sqlite3_prepare_v3(db, sql[i].c_str(), -1, SQLITE_PREPARE_PERSISTENT, &statements[i], nullptr);
+            if (rc != SQLITE_OK) { // every later call assumes its statement exists
+                Metrics::Global().CountError(METRIC_SQL + i);
+                Fail(string("cannot prepare ") + query_names[i] + " on " + config.database + ": " + sqlite3_errmsg(db));
+            }
         }
+    }
+    sqlite3_stmt* GetStatement(const Query query) { // return the cached statement, reset and ready to bind
+        sqlite3_stmt* stmt = statements[query];
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        return stmt;
+    }
+    int Step(const Query query) { // sqlite3_step on a cached statement, timed and with failures counted per statement
+        Metrics::Timer timer(METRIC_SQL + query);
+        rc = sqlite3_step(statements[query]);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) Metrics::Global().CountError(METRIC_SQL + query);
+        return rc;
+    }
+    bool ExecuteStatement(const Query query) { // run a bound write statement to completion, true on success
+        sqlite3_stmt* stmt = statements[query];
+        rc = Step(query);
+        if (rc != SQLITE_DONE) {
+            cerr << "SQL error: " << sqlite3_errmsg(db) << endl;
+            sqlite3_reset(stmt);
+            return false;
+        }
+        sqlite3_reset(stmt);
+        return true;
+    }
+    int GetRowCount(const Query count_query) { // return the amount of row in the table, 0 if nothing in table
+        sqlite3_stmt* stmt = GetStatement(count_query);
+        int row_count = 0;
+
+        rc = Step(count_query);
+        if (rc == SQLITE_ROW) row_count = sqlite3_column_int(stmt, 0);
+        else cerr << "SQL error: " << sqlite3_errmsg(db) << endl;
+        sqlite3_reset(stmt);
 
-        return column_value;
+        return row_count;
     }
-    void PrintTable(const string table_name) {
-        const int total_row = GetRowCount(table_name);
-        cout << "--------------------------------------------------------------------------------------------------------------------------" << endl;
+    CashBox GetBox(const Query select_query) { // return the note counts of a box, largest note first, all 0 if the box has no row
+        sqlite3_stmt* stmt = GetStatement(select_query);
+        CashBox denomination_value;
 
-        if (table_name == "stocks_67011140") {
-            cout << left << setw(10) << "ID" << setw(30) << "Name" << setw(20) << "Price" << "Amount" << endl;
-            cout << "--------------------------------------------------------------------------------------------------------------------------" << endl;
-            for (int i = 1; i <= total_row; i++) {
-                vector<string> values = GetRowValue(table_name, "id = " + to_string(i));
-                cout << left << setw(10) << values[0] << setw(30) << values[1] << setw(20) << values[2] << values[3] << endl;
-            }
-        } 
-        if (table_name == "change_box" || table_name == "collection_box") {
-            cout << left << setw(20) << "ID" << setw(20) << "100-THB" << setw(20) << "20-THB" << setw(20) << "10-THB" << setw(20) << "5-THB" << "1-THB" << endl;
-            cout << "--------------------------------------------------------------------------------------------------------------------------" << endl;
-            for (int i = 1; i <= total_row; i++) {
-                vector<string> values = GetRowValue(table_name, "id = " + to_string(i));
-                cout << left << setw(20) << values[0] << setw(20) << values[1] << setw(20) << values[2] << setw(20) << values[3] << setw(20) << values[4] << values[5] << endl;
+        rc = Step(select_query);
+        if (rc == SQLITE_ROW) {
+            for (int i = 0; i < bank_note.size(); i++) {
+                denomination_value[i] = sqlite3_column_int(stmt, i);
             }
+        } else if (rc != SQLITE_DONE) {
+            cerr << "SQL error: " << sqlite3_errmsg(db) << endl;
+        }
+        sqlite3_reset(stmt);
+
+        return denomination_value;
+    }
+    bool SaveBox(const Query save_query, const CashBox& box) {
+        sqlite3_stmt* stmt = GetStatement(save_query);
+        for (int i = 0; i < box.notes.size(); i++) {
+            sqlite3_bind_int(stmt, i + 1, box[i]);
+        }
+        return ExecuteStatement(save_query);
+    }
+    void SetBoxes() { // this method will only use once in contructor, it makes sure both boxes have their single row
+        if (GetRowCount(COUNT_COLLECTION_BOX) <= 0) {
+            ExecuteStatement(INSERT_COLLECTION_BOX);
+        }
+        if (GetRowCount(COUNT_CHANGE_BOX) <= 0) {
+            ExecuteStatement(INSERT_CHANGE_BOX);
         }
     }
-    void SetChangeBox(int b100, int b20, int b10, int b5, int b1) {
-        string query;
-        if (GetRowCount("change_box") <= 0) {
-            query = "INSERT INTO change_box (thb_100, thb_20, thb_10, thb_5, thb_1) VALUES (" + 
-                    to_string(b100) + ", " + to_string(b20) + ", " + to_string(b10) + ", " + to_string(b5) + ", " + to_string(b1) + ");";
-        } else { // get the value of each detomination and increment it 
-            vector<int> denomination_value; // thb_100, thb_20, thb_10, thb_5, thb_1
-            vector<string> row_value = GetRowValue("change_box", "id = 1");
+    void LoadState() { // read the stock table and both boxes into memory, every later read is served from here
+        sqlite3_stmt* stmt = GetStatement(SELECT_ALL_STOCK);
 
-            // get row_value's value into denomination_value 
-            for (int i = 1; i < row_value.size(); i++) {
-                denomination_value.push_back(stoi(row_value[i]));
-            }
+        stock.Clear();
+        while ((rc = Step(SELECT_ALL_STOCK)) == SQLITE_ROW) {
+            const int id = sqlite3_column_int(stmt, 0);
+            stock.Add(id, reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)), sqlite3_column_int(stmt, 2), sqlite3_column_int(stmt, 3));
+            next_item_id = max(next_item_id, id + 1);
+        }
+        if (rc != SQLITE_DONE) cerr << "SQL error: " << sqlite3_errmsg(db) << endl;
+        sqlite3_reset(stmt);
 
-            // set the query that will increment depend on returned value
-            query = "UPDATE change_box SET thb_100 = " + to_string(b100 + denomination_value[0]) +
-                    ", thb_20 = " + to_string(b20 + denomination_value[1]) +
-                    ", thb_10 = " + to_string(b10 + denomination_value[2]) + 
-                    ", thb_5 = " + to_string(b5 + denomination_value[3]) + 
-                    ", thb_1 = " + to_string(b1 + denomination_value[4]) + 
-                    " WHERE id = 1;";
+        change_box = GetBox(SELECT_CHANGE_BOX);
+        collection_box = GetBox(SELECT_COLLECTION_BOX);
+        last_flush = chrono::steady_clock::now();
+    }
+    void SetAmount(const int index, const int amount) { // every stock change goes through here to keep out_of_stock_count
+        out_of_stock_count += (amount <= 0) - (stock.Amount(index) <= 0);
+        stock.SetAmount(index, amount);
+    }
+    void UpdateBoxReadiness() { // call after changing either box, they only hold one count per note
+        is_change_box_empty = any_of(change_box.notes.begin(), change_box.notes.end(), [this](int n) { return n < config.min_change; });
+        is_collection_full = any_of(collection_box.notes.begin(), collection_box.notes.end(), [this](int n) { return n >= config.max_collection; });
+    }
+    void CountReadiness() { // full recount, only after loading the whole state
+        out_of_stock_count = stock.CountOutOfStock();
+        UpdateBoxReadiness();
+    }
+    void MarkDirty(const int index) {
+        if (stock.MarkDirty(index)) dirty_items.push_back(index);
+    }
+    static int Today() { return chrono::duration_cast<chrono::hours>(chrono::system_clock::now().time_since_epoch()).count() / 24; }
+    void AddHistory(const int day, const JournalRecord& sale) { // one sale into the pending per-day totals
+        DayHistory* history = nullptr;
+        for (DayHistory& slot : pending_history) {
+            if (slot.is_pending && slot.day == day) history = &slot;
         }
-        rc = sqlite3_exec(db, query.c_str(), nullptr, nullptr, &err_msg);
-        if (rc != SQLITE_OK) {
-            cerr << "SQL error: " << err_msg << endl; 
-            sqlite3_free(err_msg);
+        for (int i = 0; history == nullptr && i < pending_history.size(); i++) {
+            if (!pending_history[i].is_pending) history = &pending_history[i];
+        }
+        if (history == nullptr) history = &pending_history.emplace_back();
+        history->day = day;
+        history->is_pending = true;
+
+        const int index = stock.Find(sale.item_id);
+        if (index >= 0) {
+            if (history->sold.size() < stock.Size()) history->sold.resize(stock.Size(), 0);
+            if (history->sold[index] == 0) history->sold_items.push_back(index);
+            history->sold[index] += sale.amount;
+        }
+        for (int i = 0; i < bank_note.size(); i++) {
+            history->paid[i] += sale.notes_in[i];
+            history->change[i] += sale.notes_out[i];
         }
     }
-    void SetCollectionBox() { // this method will only use once in contructor, since it just collecting data
-        if (GetRowCount("collection_box") <= 0) {
-            const char* query = "INSERT INTO collection_box (thb_100, thb_20, thb_10, thb_5, thb_1) VALUES (0, 0, 0, 0, 0);";
-            rc = sqlite3_exec(db, query, nullptr, nullptr, &err_msg);
-            if (rc != SQLITE_OK) {
-                cerr << "SQL error: " << err_msg << endl; 
-                sqlite3_free(err_msg);
+    bool SaveHistory() { // add the pending per-day totals to the history tables, inside Flush's transaction
+        for (const DayHistory& history : pending_history) {
+            if (!history.is_pending) continue;
+            for (int index : history.sold_items) {
+                sqlite3_stmt* stmt = GetStatement(UPSERT_SALES_HISTORY);
+                sqlite3_bind_int(stmt, 1, history.day);
+                sqlite3_bind_int(stmt, 2, stock.Id(index));
+                sqlite3_bind_int(stmt, 3, history.sold[index]);
+                if (!ExecuteStatement(UPSERT_SALES_HISTORY)) return false;
+            }
+            sqlite3_stmt* stmt = GetStatement(UPSERT_CHANGE_HISTORY);
+            sqlite3_bind_int(stmt, 1, history.day);
+            for (int i = 0; i < bank_note.size(); i++) {
+                sqlite3_bind_int(stmt, 2 + i, history.paid[i]);
+                sqlite3_bind_int(stmt, 2 + bank_note.size() + i, history.change[i]);
             }
+            if (!ExecuteStatement(UPSERT_CHANGE_HISTORY)) return false;
+        }
+        return true;
+    }
+    void ClearHistory() { // after a flush, keeps every slot's memory for the next sales
+        for (DayHistory& history : pending_history) {
+            for (int index : history.sold_items) history.sold[index] = 0;
+            history.sold_items.clear();
+            history.paid = CashBox();
+            history.change = CashBox();
+            history.is_pending = false;
         }
     }
-    int EmptyCollection() { // this method will reset the collection box and return the amount of money that the admin received
-        vector<int> denomination_value; // thb_100, thb_20, thb_10, thb_5, thb_1
-        vector<string> row_value = GetRowValue("collection_box", "id = 1");
-        int sum;
+    bool HasPendingHistory() const {
+        return any_of(pending_history.begin(), pending_history.end(), [](const DayHistory& history) { return history.is_pending; });
+    }
+    void Flush() { // write every pending change back to sqlite in one transaction, kept pending if the write fails
+        last_flush = chrono::steady_clock::now();
+        if (dirty_items.empty() && !change_box_dirty && !collection_box_dirty && !HasPendingHistory()) {
+            pending_sales = 0;
+            return;
+        }
+        Metrics::Timer timer(METRIC_FLUSH);
+        if (journal_fd >= 0 && !WriteJournal()) return; // the journal must never be behind sqlite
 
-        for (int i = 1; i < row_value.size(); i++) {
-            denomination_value.push_back(stoi(row_value[i]));
+        bool is_saved = ExecuteStatement(BEGIN_TRANSACTION);
+        for (int i = 0; is_saved && i < dirty_items.size(); i++) {
+            const StockItem item = stock.Get(dirty_items[i]);
+            sqlite3_stmt* stmt = GetStatement(UPSERT_STOCK);
+            sqlite3_bind_int(stmt, 1, item.id);
+            sqlite3_bind_text(stmt, 2, item.name.data(), item.name.size(), SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 3, item.price);
+            sqlite3_bind_int(stmt, 4, item.amount);
+            sqlite3_bind_int(stmt, 5, item.amount <= 0);
+            is_saved = ExecuteStatement(UPSERT_STOCK);
         }
-        for (int i = 0; i < denomination_value.size(); i++) {
-            sum += (denomination_value[i] * bank_note[i]);
+        if (is_saved && change_box_dirty) is_saved = SaveBox(SAVE_CHANGE_BOX, change_box);
+        if (is_saved && collection_box_dirty) is_saved = SaveBox(SAVE_COLLECTION_BOX, collection_box);
+        if (is_saved) is_saved = SaveHistory();
+        if (is_saved) {
+            sqlite3_stmt* stmt = GetStatement(SAVE_JOURNAL_STATE);
+            sqlite3_bind_int64(stmt, 1, journal_sequence);
+            is_saved = ExecuteStatement(SAVE_JOURNAL_STATE);
         }
+        if (is_saved) is_saved = ExecuteStatement(COMMIT_TRANSACTION);
 
-        if (GetRowCount("collection_box") >= 1) {
-            string query = "UPDATE collection_box SET thb_100 = 0, thb_20 = 0, thb_10 = 0, thb_5 = 0, thb_1 = 0 WHERE id = 1;";
-            rc = sqlite3_exec(db, query.c_str(), nullptr, nullptr, &err_msg);
-            if (rc != SQLITE_OK) {
-                cerr << "SQL error: " << err_msg << endl; 
-                sqlite3_free(err_msg);
+        if (!is_saved) {
+            if (!sqlite3_get_autocommit(db)) ExecuteStatement(ROLLBACK_TRANSACTION);
+            return;
+        }
+        for (int index : dirty_items) stock.ClearDirty(index);
+        dirty_items.clear();
+        change_box_dirty = false;
+        collection_box_dirty = false;
+        ClearHistory();
+        pending_sales = 0;
+        if (records_since_snapshot >= config.snapshot_every) WriteSnapshot();
+    }
+    void OpenJournal() { // append-only log of every change, replayed over the last snapshot after a crash
+        if (journal_path.empty()) return;
+        journal_fd = open(journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (journal_fd < 0) cerr << "Cannot open journal " << journal_path << endl;
+        journal_buffer.reserve(JOURNAL_BUFFER_SIZE);
+        if (journal_fd < 0) return;
+        off_t size = lseek(journal_fd, 0, SEEK_END);
+        if (journal_end >= 0 && size > journal_end) { // new records must not land behind a torn one
+            if (ftruncate(journal_fd, journal_end) != 0) {
+                cerr << "Cannot truncate journal " << journal_path << endl;
+            } else {
+                cerr << "- - Dropped " << size - journal_end << " bytes of a torn journal record" << endl;
+                size = journal_end;
             }
-        } else {
-            cout << "- - The collection box has no row in it." << endl;
         }
-        return sum;
+        if (size < off_t(sizeof(JOURNAL_MAGIC) + sizeof(CurrencyTag))) { // new, or the header itself was torn
+            if (size > 0 && ftruncate(journal_fd, 0) != 0) cerr << "Cannot truncate journal " << journal_path << endl;
+            StartJournal();
+        }
+    }
+    void StartJournal() { // the header every journal file begins with
+        const CurrencyTag tag;
+        journal_buffer.insert(journal_buffer.end(), reinterpret_cast<const char*>(&JOURNAL_MAGIC), reinterpret_cast<const char*>(&JOURNAL_MAGIC) + sizeof(JOURNAL_MAGIC));
+        journal_buffer.insert(journal_buffer.end(), reinterpret_cast<const char*>(&tag), reinterpret_cast<const char*>(&tag) + sizeof(tag));
+        WriteJournal();
     }
-    void RestockItem(const string item_name, const string price, const int amount) { // this method will create / 
-        vector<string> all_item = GetColumnValue("stocks_67011140", "name");
-        int cnt = count(all_item.begin(), all_item.end(), item_name);
-        string query;
+    void AppendJournal(JournalRecord record, const string& name = "") { // buffer one record, written out when the buffer fills or before a commit
+        if (journal_fd < 0 || is_replaying) return;
+        record.sequence = ++journal_sequence;
+        record.time = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        record.name_length = name.size();
 
-        if (cnt > 0) { // already have item in it
-            string condition = "name = '" + item_name + "'";
-            int previous_amount = stoi(GetRowValue("stocks_67011140", condition)[3]);
-            query = "UPDATE stocks_67011140 SET price = '" + price + "', amount = " + to_string(previous_amount + amount) + " WHERE " + condition + ";";
-        } else { // does not have item in the machine
-            query = "INSERT INTO stocks_67011140 (name, price, amount) VALUES ('" + item_name + "', '" + price + "', " + to_string(amount) + ");";
+        const char* bytes = reinterpret_cast<const char*>(&record);
+        journal_buffer.insert(journal_buffer.end(), bytes, bytes + sizeof(record));
+        journal_buffer.insert(journal_buffer.end(), name.begin(), name.end());
+        records_since_snapshot++;
+        if (journal_buffer.size() >= JOURNAL_BUFFER_SIZE) WriteJournal();
+    }
+    bool WriteJournal() { // hand the buffered records to the os in one sequential write
+        if (journal_buffer.empty()) return true;
+        Metrics::Timer timer(METRIC_JOURNAL_WRITE);
+        for (size_t written = 0; written < journal_buffer.size();) {
+            ssize_t n = write(journal_fd, journal_buffer.data() + written, journal_buffer.size() - written);
+            if (n < 0) {
+                cerr << "Cannot write journal " << journal_path << endl;
+                journal_buffer.erase(journal_buffer.begin(), journal_buffer.begin() + written); // the retry continues where this stopped
+                return false;
+            }
+            written += n;
         }
-        rc = sqlite3_exec(db, query.c_str(), nullptr, nullptr, &err_msg);
-        if (rc != SQLITE_OK) {
-            cerr << "SQL error: " << err_msg << endl; 
-            sqlite3_free(err_msg);
+        journal_buffer.clear();
+        if (config.synchronous == "FULL" || config.synchronous == "EXTRA") fdatasync(journal_fd);
+        return true;
+    }
+    void WriteSnapshot() { // only called with nothing pending, so the snapshot matches sqlite; the journal restarts empty
+        if (journal_fd < 0 || !dirty_items.empty() || change_box_dirty || collection_box_dirty) return;
+        if (!WriteJournal()) return;
+
+        vector<char> buffer;
+        auto put = [&buffer](const void* data, size_t size) {
+            const char* bytes = static_cast<const char*>(data);
+            buffer.insert(buffer.end(), bytes, bytes + size);
+        };
+        const uint64_t item_count = stock.Size();
+        const CurrencyTag tag;
+        put(&SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        put(&tag, sizeof(tag));
+        put(&journal_sequence, sizeof(journal_sequence));
+        put(&next_item_id, sizeof(next_item_id));
+        put(&item_count, sizeof(item_count));
+        for (int i = 0; i < stock.Size(); i++) {
+            const StockItem item = stock.Get(i);
+            const int32_t fields[4] = {item.id, item.price, item.amount, (int32_t)item.name.size()};
+            put(fields, sizeof(fields));
+            put(item.name.data(), item.name.size());
+        }
+        put(change_box.notes.data(), sizeof(change_box.notes));
+        put(collection_box.notes.data(), sizeof(collection_box.notes));
+
+        const string temporary_path = snapshot_path + ".tmp";
+        int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool is_written = fd >= 0;
+        for (size_t written = 0; is_written && written < buffer.size();) {
+            ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+            is_written = n > 0;
+            written += max<ssize_t>(n, 0);
+        }
+        if (fd >= 0) {
+            is_written = is_written && fsync(fd) == 0;
+            close(fd);
+        }
+        if (!is_written || rename(temporary_path.c_str(), snapshot_path.c_str()) != 0) {
+            cerr << "Cannot write snapshot " << snapshot_path << endl;
+            return;
+        }
+        if (ftruncate(journal_fd, 0) != 0) {
+            cerr << "Cannot truncate journal " << journal_path << endl; // replay skips old records anyway
         } else {
-            cout << "- - Restock item successfully!" << endl;
+            StartJournal();
         }
+        records_since_snapshot = 0;
+    }
+    static bool ReadFile(const string& path, vector<char>& content) {
+        ifstream file(path, ios::binary);
+        if (!file) return false;
+        content.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        return true;
     }
-    vector<int> GiveChange(const int price, const int receive) { // this method will do all the increase collection, decrease change, etc. about changes
-        vector<int> change_given = {0, 0, 0, 0, 0}; 
-        vector<string> row_value = GetRowValue("change_box", "id = 1");
-        int change = receive - price;
-        int total_in_change_box = 0;
+    bool LoadSnapshot() { // rebuild the in-memory state from the snapshot file, false if there is none or it is damaged
+        vector<char> content;
+        if (snapshot_path.empty() || !ReadFile(snapshot_path, content)) return false;
+
+        size_t offset = 0;
+        auto get = [&](void* data, size_t size) {
+            if (offset + size > content.size()) return false;
+            memcpy(data, content.data() + offset, size);
+            offset += size;
+            return true;
+        };
+        uint64_t magic = 0, item_count = 0;
+        CurrencyTag tag;
+        if (!get(&magic, sizeof(magic)) || magic != SNAPSHOT_MAGIC || !get(&tag, sizeof(tag))) return false;
+        if (!(tag == CurrencyTag())) Fail(snapshot_path + " was written for " + tag.Describe() + ", this build uses " + CurrencyTag().Describe());
+        if (!get(&journal_sequence, sizeof(journal_sequence)) || !get(&next_item_id, sizeof(next_item_id)) ||
+            !get(&item_count, sizeof(item_count))) return false;
 
-        for (string s : row_value) {
-            total_in_change_box += stoi(s);
+        stock.Clear();
+        stock.Reserve(item_count);
+        for (uint64_t i = 0; i < item_count; i++) {
+            int32_t fields[4];
+            if (!get(fields, sizeof(fields)) || offset + fields[3] > content.size()) return false;
+            stock.Add(fields[0], string(content.data() + offset, fields[3]), fields[1], fields[2]);
+            offset += fields[3];
         }
-        if (total_in_change_box > change) {
-            for (int i = 0; i < bank_note.size(); i++) {
-                while (change / bank_note[i] != 0) {
-                    change_given[i] += 1;
-                    change -= bank_note[i];
+        return get(change_box.notes.data(), sizeof(change_box.notes)) && get(collection_box.notes.data(), sizeof(collection_box.notes));
+    }
+    uint64_t GetFlushedSequence() { // last journal record already written to sqlite
+        sqlite3_stmt* stmt = GetStatement(SELECT_JOURNAL_STATE);
+        uint64_t sequence = 0;
+
+        if (Step(SELECT_JOURNAL_STATE) == SQLITE_ROW) sequence = sqlite3_column_int64(stmt, 0);
+        sqlite3_reset(stmt);
+        return sequence;
+    }
+    void ReplayJournal() { // apply every record after the loaded state, and mark what it touched for the next flush
+        vector<char> content;
+        if (journal_path.empty() || !ReadFile(journal_path, content) || content.empty()) return;
+
+        uint64_t magic = 0;
+        CurrencyTag tag;
+        journal_end = 0;
+        if (content.size() < sizeof(magic) + sizeof(tag)) return; // torn header, nothing was recorded after it
+        memcpy(&magic, content.data(), sizeof(magic));
+        memcpy(&tag, content.data() + sizeof(magic), sizeof(tag));
+        if (magic != JOURNAL_MAGIC) Fail(journal_path + " has no journal header, it was written by an older build");
+        if (!(tag == CurrencyTag())) Fail(journal_path + " was written for " + tag.Describe() + ", this build uses " + CurrencyTag().Describe());
+
+        const uint64_t loaded_sequence = journal_sequence;
+        int replayed = 0;
+        is_replaying = true;
+        size_t offset = sizeof(magic) + sizeof(tag);
+        while (offset + sizeof(JournalRecord) <= content.size()) {
+            JournalRecord record;
+            memcpy(&record, content.data() + offset, sizeof(record));
+            if (record.name_length < 0 || offset + sizeof(record) + record.name_length > content.size()) break; // torn last record
+            string name(content.data() + offset + sizeof(record), record.name_length);
+            offset += sizeof(record) + record.name_length;
+            if (record.sequence <= loaded_sequence) continue;
+
+            ApplyJournalRecord(record, name);
+            journal_sequence = record.sequence;
+            records_since_snapshot++;
+            replayed++;
+        }
+        journal_end = offset;
+        is_replaying = false;
+        if (replayed > 0) cerr << "- - Recovered " << replayed << " journal records" << endl;
+    }
+    void ApplyJournalRecord(const JournalRecord& record, const string& name) {
+        switch (record.type) {
+            case JOURNAL_SALE: {
+                const int index = stock.Find(record.item_id);
+                if (index >= 0) {
+                    SetAmount(index, stock.Amount(index) - 1);
+                    MarkDirty(index);
+                }
+                for (int i = 0; i < bank_note.size(); i++) {
+                    collection_box[i] += record.notes_in[i];
+                    change_box[i] -= record.notes_out[i];
                 }
+                change_box_dirty = collection_box_dirty = true;
+                if (record.sequence > history_sequence) AddHistory(record.time / (86400LL * 1000000), record);
+                UpdateBoxReadiness();
+                break;
             }
-        } else {
-            return {0};
+            case JOURNAL_RESTOCK:
+                UpsertItem(name, record.price, record.amount);
+                break;
+            case JOURNAL_REFILL:
+                for (int i = 0; i < bank_note.size(); i++) change_box[i] += record.notes_in[i];
+                change_box_dirty = true;
+                break;
+            case JOURNAL_COLLECT:
+                for (int i = 0; i < bank_note.size(); i++) collection_box[i] = 0;
+                collection_box_dirty = true;
+                break;
+            case JOURNAL_SET_CHANGE_BOX:
+                copy(record.notes_in, record.notes_in + bank_note.size(), change_box.notes.begin());
+                change_box_dirty = true;
+                break;
+            case JOURNAL_SET_COLLECTION_BOX:
+                copy(record.notes_in, record.notes_in + bank_note.size(), collection_box.notes.begin());
+                collection_box_dirty = true;
+                break;
         }
-        return change_given;
+        UpdateBoxReadiness();
     }
-    void BuyItem(const int id) { // this is the method that will reduce the amount by 1
-        vector<string> row_value = GetRowValue("stocks_67011140", "id = " + to_string(id));
-        int amount = stoi(row_value[3]);
-        string query;
+    void RecoverState() { // latest snapshot (or the sqlite tables) plus the journal tail, then bring sqlite up to date
+        history_sequence = GetFlushedSequence(); // the snapshot may be older than sqlite, its later sales are already counted
+        if (!LoadSnapshot()) {
+            LoadState();
+            journal_sequence = history_sequence;
+        }
+        last_flush = chrono::steady_clock::now();
+        CountReadiness();
+        ReplayJournal();
+        Flush();
+    }
+    void EndUnitOfWork() { // called once a sale or admin operation is fully applied, commits a group of them together
+        if (journal_fd >= 0) WriteJournal(); // one write per unit, a crashed process loses no finished sale
+        pending_sales++;
+        if (!config.background_flush) FlushIfDue();
+    }
+    bool GetItem(const int id, StockItem& item) { // copy the item out without allocating, false if there is no item with this id
+        const int index = stock.Find(id);
+        if (index < 0) return false;
+        item = stock.Get(index);
+        return true;
+    }
+    void AppendCell(const string_view text, const int width) { // left aligned like setw, pads with spaces up to width
+        table_buffer.append(text.data(), text.size());
+        if (width > (int)text.size()) table_buffer.append(width - text.size(), ' ');
+    }
+    static string_view FormatNumber(const int value, char (&digits)[12]) {
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        return string_view(digits, result.ptr - digits);
+    }
+    static string FormatPrice(const int satang) { // whole units, with the minor units only when there are any
+        string price = to_string(satang / MINOR_PER_UNIT);
+        if (satang % MINOR_PER_UNIT != 0) {
+            const int rest = abs(satang % MINOR_PER_UNIT);
+            price += (rest < 10 ? ".0" : ".") + to_string(rest);
+        }
+        return price;
+    }
+    void PrintTable(const string table_name, const int first_row = 0, const int row_count = -1) { // render the table, or one page of the stock table, with a single write
+        char digits[12];
+        table_buffer.clear();
 
-        if (amount >= 1) {
-            query = "UPDATE stocks_67011140 SET amount = " + to_string(amount - 1) + " WHERE id = " + to_string(id) + ";";
-            rc = sqlite3_exec(db, query.c_str(), nullptr, nullptr, &err_msg);
-            if (rc != SQLITE_OK) {
-                cerr << "SQL error: " << err_msg << endl; 
-                sqlite3_free(err_msg);
+        if (table_name == "stocks_67011140") {
+            const int begin = min(max(first_row, 0), stock.Size());
+            const int end = row_count < 0 ? stock.Size() : min(stock.Size(), begin + row_count);
+            int id_width = 2, name_width = 4, price_width = 5, amount_width = 6; // at least as wide as the headers
+
+            for (int i = begin; i < end; i++) { // size the columns to the widest value on the page
+                const StockItem item = stock.Get(i);
+                id_width = max<int>(id_width, FormatNumber(item.id, digits).size());
+                name_width = max<int>(name_width, item.name.size());
+                price_width = max<int>(price_width, item.amount > 0 ? FormatPrice(item.price).size() : 12);
+                amount_width = max<int>(amount_width, FormatNumber(item.amount, digits).size());
+            }
+            id_width += 4;
+            name_width += 4;
+            price_width += 4;
+
+            const int line_width = id_width + name_width + price_width + amount_width;
+            table_buffer.append(line_width, '-').append("\n");
+            AppendCell("ID", id_width);
+            AppendCell("Name", name_width);
+            AppendCell("Price", price_width);
+            table_buffer.append("Amount\n").append(line_width, '-').append("\n");
+            for (int i = begin; i < end; i++) {
+                const StockItem item = stock.Get(i);
+                AppendCell(FormatNumber(item.id, digits), id_width);
+                AppendCell(item.name, name_width);
+                AppendCell(item.amount > 0 ? FormatPrice(item.price) : "OUT OF STOCK", price_width);
+                table_buffer.append(FormatNumber(item.amount, digits)).append("\n");
+            }
+        } 
+        if (table_name == "change_box" || table_name == "collection_box") {
+            const CashBox& values = table_name == "change_box" ? change_box : collection_box;
+            table_buffer.append(122, '-').append("\n");
+            AppendCell("ID", 20);
+            for (int i = 0; i < bank_note.size(); i++) {
+                string header = to_string(bank_note[i]) + "-" + Currency::code;
+                transform(header.begin(), header.end(), header.begin(), ::toupper);
+                AppendCell(header, i + 1 < bank_note.size() ? 20 : 0);
+            }
+            table_buffer.append("\n").append(122, '-').append("\n");
+            AppendCell("1", 20);
+            for (int i = 0; i < values.notes.size(); i++) {
+                AppendCell(FormatNumber(values[i], digits), i + 1 < values.notes.size() ? 20 : 0);
             }
+            table_buffer.append("\n");
+        }
+        cout.write(table_buffer.data(), table_buffer.size());
+        cout.flush();
+    }
+    void SetChangeBox(const CashBox& delta) { // increment each denomination of the change box
+        Metrics::Timer timer(METRIC_SET_CHANGE_BOX);
+        change_box += delta;
+        change_box_dirty = true;
+        UpdateBoxReadiness();
+    }
+    int64_t EmptyCollection() { // this method will reset the collection box and return the amount of money that the admin received
+        Metrics::Timer timer(METRIC_EMPTY_COLLECTION);
+        JournalRecord record;
+        int64_t sum = collection_box.Total();
+
+        record.type = JOURNAL_COLLECT;
+        for (int i = 0; i < collection_box.notes.size(); i++) {
+            record.notes_out[i] = collection_box[i];
+            collection_box[i] = 0;
+        }
+        collection_box_dirty = true;
+        UpdateBoxReadiness();
+        AppendJournal(record);
+        EndUnitOfWork();
+        return sum;
+    }
+    void UpsertItem(const string& item_name, const int price, const int amount) { // one hash lookup: add to the item with this name or create it, price in satang
+        auto [index, is_new] = stock.FindOrAdd(item_name, next_item_id);
+
+        if (is_new) { // does not have item in the machine
+            next_item_id++;
+            out_of_stock_count++; // a new item starts with nothing in it
+        }
+        stock.SetPrice(index, price);
+        SetAmount(index, stock.Amount(index) + amount);
+        MarkDirty(index);
+
+        JournalRecord record;
+        record.type = JOURNAL_RESTOCK;
+        record.item_id = stock.Id(index);
+        record.price = price;
+        record.amount = amount;
+        AppendJournal(record, item_name);
+    }
+    void RestockItem(const string& item_name, const int price, const int amount) { // this method will create / add to an item
+        Metrics::Timer timer(METRIC_RESTOCK_ITEM);
+        UpsertItem(item_name, price, amount);
+        EndUnitOfWork();
+    }
+    void RestockItems(const vector<RestockEntry>& entries) { // bulk restock, every entry goes to sqlite in the same commit
+        stock.Reserve(stock.Size() + entries.size());
+        for (const RestockEntry& entry : entries) {
+            UpsertItem(entry.name, entry.price, entry.amount);
+        }
+        EndUnitOfWork();
+    }
+    bool GiveChange(const int price, const int receive, CashBox& change_given) { // work out the change from the notes actually in the change box, false if it cannot be paid (both in minor units)
+        Metrics::Timer timer(METRIC_GIVE_CHANGE, Metrics::HOT_SAMPLE_EVERY);
+        const int change = receive - price;
+        if (change % MINOR_PER_UNIT != 0) return false; // the change box only holds whole units
+        return change_maker.MakeChange(change / MINOR_PER_UNIT, change_box, change_given);
+    }
+    void BuyItem(const int id) { // this is the method that will reduce the amount by 1
+        Metrics::Timer timer(METRIC_BUY_ITEM, Metrics::HOT_SAMPLE_EVERY);
+        const int index = stock.Find(id);
+
+        if (index >= 0 && stock.Amount(index) >= 1) {
+            SetAmount(index, stock.Amount(index) - 1);
+            MarkDirty(index);
         } else {
             cout << "- - Sorry, the item is out of stock" << endl;
         }
     }
-    bool CheckOutOfStock() { // this method will check if more than half of the table is out of stock or not, and also display out of stock for item with amount = 0
-        const int total_row = GetRowCount("stocks_67011140");
-        int total_out_of_stock = 0;
-
-        if (GetRowCount("stocks_67011140") > 0) {
-            for (int i = 1; i <= total_row; i++) {
-                vector<string> temp_value = GetRowValue("stocks_67011140", "id = " + to_string(i));
-                if (stoi(temp_value[3]) <= 0) {
-                    total_out_of_stock++;
-                    string query = "UPDATE stocks_67011140 SET price = 'OUT OF STOCK', amount = 0 WHERE id = " + to_string(i) + ";";
-                    rc = sqlite3_exec(db, query.c_str(), nullptr, nullptr, &err_msg);
-                    if (rc != SQLITE_OK) {
-                        cerr << "SQL error: " << err_msg << endl; 
-                        sqlite3_free(err_msg);
-                    }
-                }
+    static bool SplitCsv(const string& line, vector<string>& fields) { // split one csv line, "quoted, fields" may hold commas and "" quotes
+        fields.clear();
+        string field;
+        bool is_quoted = false;
+
+        for (int i = 0; i < line.size(); i++) {
+            char c = line[i];
+            if (is_quoted) {
+                if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') field += line[++i];
+                else if (c == '"') is_quoted = false;
+                else field += c;
+            } else if (c == '"') {
+                is_quoted = true;
+            } else if (c == ',') {
+                fields.push_back(field);
+                field.clear();
+            } else if (c != '\r') {
+                field += c;
             }
         }
-        return total_out_of_stock >= (total_row / 2);
-    } 
-    bool CheckCollectionFull() { // this will check each bank note whether its reach the limit or not (1 if the machine will stop, 0 the machine will run)
-        if (GetRowCount("collection_box") >= 1) {
-            vector<string> row_value = GetRowValue("collection_box", "id = 1");
+        fields.push_back(field);
+        return !is_quoted;
+    }
+    static bool ParseCsvInt(const string& field, int& value) {
+        auto result = from_chars(field.data(), field.data() + field.size(), value);
+        return result.ec == errc() && result.ptr == field.data() + field.size();
+    }
+    static string QuoteCsv(const string& field) {
+        if (field.find_first_of(",\"\n") == string::npos) return field;
+        string quoted = "\"";
+        for (char c : field) {
+            if (c == '"') quoted += '"';
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+    int ImportStock(istream& in) { // name,price,amount rows are restocked like admin option 2 and committed together, returns rows imported
+        string line;
+        vector<string> fields;
+        int imported = 0;
 
-            for (int i = 1; i < row_value.size(); i++) {
-                if (stoi(row_value[i]) >= max_collection) return 1;
+        for (int line_number = 1; getline(in, line); line_number++) {
+            int price, amount;
+            if (line.empty() || line == "\r") continue;
+            if (!SplitCsv(line, fields) || fields.size() != 3 || fields[0].empty() ||
+                !ParseCsvInt(fields[1], price) || !ParseCsvInt(fields[2], amount) || !IsValidStock(price, amount)) {
+                if (line_number > 1) cerr << "- - Skipped stock line " << line_number << ": " << line << endl; // line 1 may be a header
+                continue;
             }
-            return 0;
+            UpsertItem(fields[0], price * MINOR_PER_UNIT, amount);
+            imported++;
         }
-        return 1;
+        Flush();
+        return imported;
     }
-    bool CheckChangeBoxEmpty() { // this will check if any bank note in change box reach 0 or not
-        if (GetRowCount("change_box") >= 1) {
-            vector<string> row_value = GetRowValue("change_box", "id = 1");
+    int ImportBoxes(istream& in) { // box,<count per note> rows (box,100,20,10,5,1 for baht) replace the change box or collection box, returns rows imported
+        string line;
+        vector<string> fields;
+        int imported = 0;
 
-            for (int i = 1; i < row_value.size(); i++) {
-                if (stoi(row_value[i]) <= 0) return 1;
+        for (int line_number = 1; getline(in, line); line_number++) {
+            if (line.empty() || line == "\r") continue;
+            bool is_valid = SplitCsv(line, fields) && fields.size() == bank_note.size() + 1 &&
+                            (fields[0] == "change_box" || fields[0] == "collection_box");
+            CashBox notes;
+            for (int i = 0; is_valid && i < bank_note.size(); i++) {
+                is_valid = ParseCsvInt(fields[i + 1], notes[i]) && notes[i] >= 0 && notes[i] <= MAX_COUNT;
             }
-            return 0;
+            if (!is_valid) {
+                if (line_number > 1) cerr << "- - Skipped cash line " << line_number << ": " << line << endl;
+                continue;
+            }
+            JournalRecord record;
+            copy(notes.notes.begin(), notes.notes.end(), record.notes_in);
+            if (fields[0] == "change_box") {
+                record.type = JOURNAL_SET_CHANGE_BOX;
+                change_box = notes;
+                change_box_dirty = true;
+            } else {
+                record.type = JOURNAL_SET_COLLECTION_BOX;
+                collection_box = notes;
+                collection_box_dirty = true;
+            }
+            UpdateBoxReadiness();
+            AppendJournal(record);
+            imported++;
         }
-        return 1;
+        Flush();
+        return imported;
+    }
+    int ExportStock(ostream& out) { // stream the stock table straight from a sqlite cursor as name,price,amount (price in whole units), returns rows written
+        Flush();
+        sqlite3_stmt* stmt = GetStatement(SELECT_ALL_STOCK);
+        int exported = 0;
+
+        out << "name,price,amount\n";
+        while ((rc = Step(SELECT_ALL_STOCK)) == SQLITE_ROW) {
+            out << QuoteCsv(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1))) << ','
+                << FormatPrice(sqlite3_column_int(stmt, 2)) << ',' << sqlite3_column_int(stmt, 3) << '\n';
+            exported++;
+        }
+        if (rc != SQLITE_DONE) cerr << "SQL error: " << sqlite3_errmsg(db) << endl;
+        sqlite3_reset(stmt);
+        out.flush();
+        return exported;
+    }
+    int ExportBoxes(ostream& out) { // write both box rows as box,<count per note>, returns rows written
+        Flush();
+        out << "box";
+        for (int note : bank_note) out << ',' << note;
+        out << '\n';
+        for (auto [box_name, select_query] : {pair<const char*, Query>{"change_box", SELECT_CHANGE_BOX}, {"collection_box", SELECT_COLLECTION_BOX}}) {
+            out << box_name;
+            for (int n : GetBox(select_query).notes) out << ',' << n;
+            out << '\n';
+        }
+        out.flush();
+        return 2;
+    }
+    SaleResult SellItem(const int id, const CashBox& inserted, CashBox& change_given) { // one sale as a single unit: collect the payment, pay out the change and take the item, or change nothing
+        Metrics::Timer timer(METRIC_SELL_ITEM, Metrics::HOT_SAMPLE_EVERY);
+        StockItem item;
+
+        if (!GetItem(id, item)) return NO_SUCH_ITEM;
+        if (item.amount < 1) return OUT_OF_STOCK;
+        if (!inserted.IsValid()) return INVALID_NOTE;
+        const int64_t payment = inserted.Total() * MINOR_PER_UNIT;
+        if (payment > MAX_PAYMENT) return INVALID_NOTE;
+        if (payment < item.price) return NOT_ENOUGH_PAYMENT;
+
+        if (!GiveChange(item.price, int(payment), change_given)) return NO_CHANGE;
+
+        collection_box += inserted;
+        collection_box_dirty = true;
+        SetChangeBox(-change_given);
+        BuyItem(id);
+
+        JournalRecord record;
+        record.type = JOURNAL_SALE;
+        record.item_id = id;
+        record.price = item.price;
+        record.amount = 1;
+        copy(inserted.notes.begin(), inserted.notes.end(), record.notes_in);
+        copy(change_given.notes.begin(), change_given.notes.end(), record.notes_out);
+        AddHistory(Today(), record);
+        AppendJournal(record);
+        EndUnitOfWork();
+        return SOLD;
+    }
+    bool CheckOutOfStock() { // this method will check if more than half of the table is out of stock or not
+        return out_of_stock_count >= (stock.Size() / 2);
+    } 
+    bool CheckCollectionFull() { // this will check each bank note whether its reach the limit or not (1 if the machine will stop, 0 the machine will run)
+        return is_collection_full;
+    }
+    bool CheckChangeBoxEmpty() { // this will check if any bank note in change box reach 0 or not
+        return is_change_box_empty;
     }
 
 public:
-    VendingMachine() { // constructor
+    VendingMachine(const MachineConfig& machine_config = MachineConfig()) : config(machine_config) { // constructor
+        if (!config.machine_name.empty()) { // namespace the tables so machines can share a database
+            for (char c : config.machine_name) {
+                if (!isalnum(static_cast<unsigned char>(c)) && c != '_') throw invalid_argument("invalid machine name: " + config.machine_name);
+            }
+            stock_table = config.machine_name + "_" + stock_table;
+            change_box_table = config.machine_name + "_" + change_box_table;
+            collection_box_table = config.machine_name + "_" + collection_box_table;
+            journal_state_table = config.machine_name + "_" + journal_state_table;
+            sales_history_table = config.machine_name + "_" + sales_history_table;
+            change_history_table = config.machine_name + "_" + change_history_table;
+        }
+        // both pragmas are pasted into sql, only accept the values sqlite defines
+        const vector<string> journal_modes = {"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"};
+        const vector<string> synchronous_levels = {"OFF", "NORMAL", "FULL", "EXTRA"};
+        if (find(journal_modes.begin(), journal_modes.end(), config.journal_mode) == journal_modes.end()) {
+            throw invalid_argument("invalid journal mode: " + config.journal_mode);
+        }
+        if (find(synchronous_levels.begin(), synchronous_levels.end(), config.synchronous) == synchronous_levels.end()) {
+            throw invalid_argument("invalid synchronous level: " + config.synchronous);
+        }
+        if (config.journal && !config.database.empty() && config.database != ":memory:") {
+            string base = config.database + (config.machine_name.empty() ? "" : "." + config.machine_name);
+            journal_path = base + ".journal";
+            snapshot_path = base + ".snapshot";
+        }
         CreateDatabase();
-        SetCollectionBox();
-        SetChangeBox(0,0,0,0,0);
+        PrepareStatements();
+        SetBoxes();
+        RecoverState();
+        OpenJournal();
+    }
+    VendingMachine(const VendingMachine&) = delete; // owns the connection and its statements
+    VendingMachine& operator=(const VendingMachine&) = delete;
+    ~VendingMachine() { // destructor, write back whatever is still pending and snapshot so the next start replays nothing
+        Flush();
+        if (records_since_snapshot > 0) WriteSnapshot();
+        if (journal_fd >= 0) close(journal_fd);
+        for (sqlite3_stmt* stmt : statements) sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    }
+    class Sale { // one customer's sale driven by events: select an item, insert notes, or cancel for a refund
+    private:     // inserted notes wait in escrow and the machine is untouched until they cover the price
+        int item_id = 0;
+        int price = 0;        // satang
+        int paid = 0;         // satang
+        CashBox inserted;     // escrow
+
+        void Reset() {
+            item_id = 0;
+            price = 0;
+            paid = 0;
+            inserted = CashBox();
+        }
+        SaleResult Complete(VendingMachine& vm, CashBox& change_given) { // change, commit and dispense as one unit, a refused sale hands the escrow back
+            const SaleResult result = vm.SellItem(item_id, inserted, change_given);
+            if (result != SOLD) change_given = inserted;
+            Reset();
+            return result;
+        }
+
+    public:
+        bool HasEscrow() const { return paid > 0; }
+        int ItemId() const { return item_id; }
+        int Due() const { return max(0, price - paid); } // satang still to insert
+        SaleResult Select(VendingMachine& vm, const int id, CashBox& change_given) { // pick or switch the item, completes at once if the escrow already covers it
+            StockItem item;
+            change_given = CashBox();
+            if (!vm.GetItem(id, item)) return NO_SUCH_ITEM;
+            if (item.amount < 1) return OUT_OF_STOCK;
+            item_id = id;
+            price = item.price;
+            return paid >= price ? Complete(vm, change_given) : NOT_ENOUGH_PAYMENT;
+        }
+        SaleResult Insert(VendingMachine& vm, const CashBox& notes, CashBox& change_given, const bool is_all_or_nothing = false) { // one insertion event
+            change_given = CashBox();
+            if (!notes.IsValid()) return INVALID_NOTE;
+            if (item_id == 0) return NO_ITEM_SELECTED;
+
+            const int64_t value = notes.Total() * MINOR_PER_UNIT;
+            if (paid + value > MAX_PAYMENT) return INVALID_NOTE; // leave the escrow as it was
+            if (is_all_or_nothing && paid + value < price) return NOT_ENOUGH_PAYMENT; // leave the escrow as it was
+
+            inserted += notes;
+            paid += value;
+            return paid >= price ? Complete(vm, change_given) : NOT_ENOUGH_PAYMENT;
+        }
+        SaleResult InsertNote(VendingMachine& vm, const int note, const int count, CashBox& change_given) { // count notes worth note units each
+            const auto it = find(bank_note.begin(), bank_note.end(), note);
+            change_given = CashBox();
+            if (it == bank_note.end() || count <= 0 || count > MAX_COUNT) return INVALID_NOTE;
+
+            CashBox notes;
+            notes[it - bank_note.begin()] = count;
+            return Insert(vm, notes, change_given);
+        }
+        CashBox Cancel() { // give back everything in escrow and forget the selection
+            CashBox refund = inserted;
+            Reset();
+            return refund;
+        }
+    };
+
+    const string& GetName() const { return config.machine_name; }
+    bool IsFlushDue() const { // enough units of work, or old enough, to be written to sqlite
+        return pending_sales > 0 && (pending_sales >= config.sales_per_commit ||
+                                     chrono::steady_clock::now() - last_flush >= chrono::seconds(config.flush_interval));
+    }
+    void FlushIfDue() {
+        if (IsFlushDue()) Flush();
+    }
+    bool IsReady() { // false while the machine would refuse customers
+        Metrics::Timer timer(METRIC_READINESS, Metrics::HOT_SAMPLE_EVERY);
+        return !(CheckOutOfStock() || CheckCollectionFull() || CheckChangeBoxEmpty());
+    }
+    static constexpr const array<int, NOTE_COUNT>& GetBankNotes() { return bank_note; }
+    bool FindItem(const int id, StockItem& item) { return GetItem(id, item); } // false if there is no item with this id
+    SaleResult Purchase(const int id, const CashBox& inserted, CashBox& change_given) {
+        return SellItem(id, inserted, change_given);
+    }
+    void Restock(const string& item_name, const int price, const int amount) { // price in satang
+        RestockItem(item_name, price, amount);
+    }
+    void Restock(const vector<RestockEntry>& entries) {
+        RestockItems(entries);
+    }
+    void Refill(const CashBox& notes) { // add notes to the change box
+        JournalRecord record;
+        record.type = JOURNAL_REFILL;
+        copy(notes.notes.begin(), notes.notes.end(), record.notes_in);
+
+        SetChangeBox(notes);
+        AppendJournal(record);
+        EndUnitOfWork();
+    }
+    static bool IsValidStock(const int price, const int amount) { // restock input, price in whole units
+        return price >= 0 && price <= MAX_PRICE && amount >= 0 && amount <= MAX_COUNT;
+    }
+    int64_t Collect() { // empty the collection box, return the amount collected
+        return EmptyCollection();
+    }
+    int Import(const string& table, istream& in) { // table is "stock" or "cash", returns rows imported or -1 for an unknown table
+        if (table == "stock") return ImportStock(in);
+        if (table == "cash") return ImportBoxes(in);
+        return -1;
+    }
+    int Export(const string& table, ostream& out) {
+        if (table == "stock") return ExportStock(out);
+        if (table == "cash") return ExportBoxes(out);
+        return -1;
+    }
+    MachinePlan Plan() { // forecast depletion from the sales history and work out what to bring on the next visit
+        Flush(); // the history tables must hold everything sold so far
+        MachinePlan plan;
+        CashBox paid, change;
+        const int today = Today();
+        const double horizon = config.plan_horizon_days;
+
+        plan.machine = config.machine_name;
+        sqlite3_stmt* stmt = GetStatement(SELECT_CHANGE_HISTORY);
+        sqlite3_bind_int(stmt, 1, today - config.history_days + 1);
+        if (Step(SELECT_CHANGE_HISTORY) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            plan.days_observed = today - sqlite3_column_int(stmt, 0) + 1;
+            for (int i = 0; i < bank_note.size(); i++) {
+                paid[i] = sqlite3_column_int(stmt, 1 + i);
+                change[i] = sqlite3_column_int(stmt, 1 + bank_note.size() + i);
+            }
+        }
+        sqlite3_reset(stmt);
+
+        // change box: keep min_change of each note after the horizon's worth of change
+        const double days = max(plan.days_observed, 1);
+        for (int i = 0; i < bank_note.size(); i++) {
+            plan.change_per_day[i] = change[i] / days;
+            plan.change_refill[i] = max(0, (int)ceil(plan.change_per_day[i] * horizon) + config.min_change - change_box[i]);
+            if (paid[i] > 0) {
+                const double days_left = max(0, config.max_collection - collection_box[i]) / (paid[i] / days);
+                if (plan.days_to_collection < 0 || days_left < plan.days_to_collection) plan.days_to_collection = days_left;
+            }
+        }
+        if (plan.days_observed == 0) return plan;
+
+        // items: only the ones that would sell out before the next visit
+        stmt = GetStatement(SELECT_SALES_HISTORY);
+        sqlite3_bind_int(stmt, 1, today - config.history_days + 1);
+        while (Step(SELECT_SALES_HISTORY) == SQLITE_ROW) {
+            const int index = stock.Find(sqlite3_column_int(stmt, 0));
+            const int64_t sold = sqlite3_column_int64(stmt, 1);
+            if (index < 0 || sold <= 0) continue; // no longer in the catalog
+
+            ItemPlan item;
+            item.id = stock.Id(index);
+            item.amount = max(0, stock.Amount(index));
+            item.sold_per_day = sold / days;
+            item.days_left = item.amount / item.sold_per_day;
+            item.restock = max(0, (int)ceil(item.sold_per_day * horizon) - item.amount);
+            if (item.restock == 0) continue;
+            item.name = stock.Name(index);
+            plan.items.push_back(move(item));
+        }
+        sqlite3_reset(stmt);
+        sort(plan.items.begin(), plan.items.end(), [](const ItemPlan& a, const ItemPlan& b) { return a.days_left < b.days_left; });
+        return plan;
     }
     void UserMode() {
         string user_input;
@@ -332,39 +1698,39 @@ public:
                 if (user_input == "0") break;
                 int id = stoi(user_input);
 
-                if (0 < id && id <= GetRowCount("stocks_67011140")) {
-                    vector<string> row_value = GetRowValue("stocks_67011140", "id = " + to_string(id));
-                    if (stoi(row_value[3]) == 0) {
-                        cout << "\n- - The selected item is out of stock." << endl;
-                    } else {
-                        int price = stoi(row_value[2]);
-                        int payment = 0;
-
-                        while (payment < price) {
-                            for (int i : {100, 20, 10, 5, 1}) {
-                                int temp = 0;
-                                if (i > 15) cout << "Enter " << i << " bills: ";
-                                else cout << "Enter " << i << " coins: ";
-                                cin >> temp;
-                                payment += temp * i;
-                            }
-                            if (payment < price) cout << "\n- - The payment is not enough" << endl;
-                        }
-                        vector<int> changes = GiveChange(price, payment);
-                        if (changes.size() > 1) {
-                            SetChangeBox(changes[0] * -1, changes[1] * -1, changes[2] * -1, changes[3] * -1, changes[4] * -1); // next, check if the change box have enough change, cannot be negative
-                            cout << "\n- - The vending machine returns some changes." << endl;
-                            for (int i = 0; i < changes.size(); i++) {
-                                cout << to_string(bank_note[i]) + " baht: " << changes[i] << endl;
-                            }
-                            BuyItem(id);
-                            is_purchased = true;
-                        } else {
-                            cout << "\n- - The change box doesn't has enough money. Please come again later." << endl;
-                        }
+                Sale sale;
+                CashBox changes;
+                SaleResult result = sale.Select(*this, id, changes);
+                if (result == OUT_OF_STOCK) cout << "\n- - The selected item is out of stock." << endl;
+                if (result != NOT_ENOUGH_PAYMENT && result != SOLD) continue; // a free item is sold by the selection itself
+
+                while (result == NOT_ENOUGH_PAYMENT) { // one event per note until the price is covered or the customer cancels
+                    int note = 0;
+                    cout << "\n- - " << FormatPrice(sale.Due()) << " " << Currency::unit << " to go. Insert a bill or coin (";
+                    for (int i = 0; i < NOTE_COUNT; i++) cout << (i ? ", " : "") << bank_note[i];
+                    cout << "), 0 to cancel\n> ";
+                    if (!(cin >> note)) note = 0;
+                    if (note == 0) {
+                        changes = sale.Cancel();
+                        cout << "\n- - The sale is cancelled, please take your money back." << endl;
                         break;
                     }
+                    result = sale.InsertNote(*this, note, 1, changes);
+                    if (result == INVALID_NOTE) {
+                        cout << "\n- - The machine does not take " << note << " " << Currency::unit << "." << endl;
+                        result = NOT_ENOUGH_PAYMENT;
+                    }
                 }
+                if (result == SOLD) {
+                    cout << "\n- - The vending machine returns some changes." << endl;
+                    is_purchased = true;
+                } else if (result != NOT_ENOUGH_PAYMENT) {
+                    cout << "\n- - The change box doesn't has enough money. Please come again later." << endl;
+                }
+                if (result != NOT_ENOUGH_PAYMENT || changes.Total() > 0) {
+                    for (int i = 0; i < NOTE_COUNT; i++) cout << bank_note[i] << " " << Currency::unit << ": " << changes[i] << endl;
+                }
+                break;
             }
             if (is_purchased) { // (worked)
                 string user_input2;
@@ -382,45 +1748,97 @@ public:
         while (true) {
             string inpt = "";
             cout << "\n- - Hello, admin! What will you do?\n1) View items\n2) Set stock / Restock\n3) Check change box / collection box" << endl; 
-            cout << "4) Collect money\n5) Refill change box\n0) quit\n> ";
+            cout << "4) Collect money\n5) Refill change box\n6) Import from csv\n7) Export to csv\n8) View metrics\n9) Restock plan\n0) quit\n> ";
             cin >> inpt;
             if (inpt == "1") { // print stock table (worked)
+                const int pages = max(1, (stock.Size() + page_size - 1) / page_size);
+                int page = 1;
+
                 cout << "\n- - Vending Machine's all items" << endl;
-                PrintTable("stocks_67011140");
+                while (true) {
+                    PrintTable("stocks_67011140", (page - 1) * page_size, page_size);
+                    if (pages == 1) break;
+
+                    string page_input;
+                    cout << "\n- - Page " << page << " of " << pages << ". Enter a page number (0 to go back)\n> ";
+                    cin >> page_input;
+                    int next_page = 0;
+                    from_chars(page_input.data(), page_input.data() + page_input.size(), next_page);
+                    if (next_page < 1 || next_page > pages) break;
+                    page = next_page;
+                }
             } else if (inpt == "2") { // set stock / restock item (worked)
                 string name;
-                string price;
+                int price;
                 int amount;
 
                 cout << "\n- - Enter the item's data (name price amount)\n> ";
                 ((cin >> name) >> price) >> amount;
+                if (!cin || !IsValidStock(price, amount)) {
+                    cin.clear();
+                    cout << "- - The price must be 0 to " << MAX_PRICE << " and the amount 0 to " << MAX_COUNT << "." << endl;
+                    continue;
+                }
 
-                RestockItem(name, price, amount);
+                RestockItem(name, price * MINOR_PER_UNIT, amount);
+                cout << "- - Restock item successfully!" << endl;
             } else if (inpt == "3") { // print change box / collection box (worked)
-                if (GetRowCount("change_box") > 0) {
-                    cout << "\n- - Change box information: " << endl;
-                    PrintTable("change_box");
+                cout << "\n- - Change box information: " << endl;
+                PrintTable("change_box");
+                cout << "\n- - Collection box information: " << endl;
+                PrintTable("collection_box");
+            } else if (inpt == "4") { // collect money from collection box (worked)
+                int64_t sum = EmptyCollection();
+                cout << "\n- - You've collected " << sum << " " << Currency::unit << "!" << endl;
+            } else if (inpt == "5") { // refill change box (worked)
+                CashBox amount_of_notes;
+                for (int i = 0; i < NOTE_COUNT && cin; i++) {
+                    string temp;
+                    cout << "\n- - Enter an amount of " << bank_note[i] << " " << Currency::unit << "\n> ";
+                    cin >> temp;
+                    if (cin && (!ParseCsvInt(temp, amount_of_notes[i]) || amount_of_notes[i] < 0 || amount_of_notes[i] > MAX_COUNT)) {
+                        cout << "- - The amount must be a number from 0 to " << MAX_COUNT << "." << endl;
+                        i--; // ask for the same note again
+                    }
+                }
+                if (cin) Refill(amount_of_notes);
+            } else if (inpt == "6" || inpt == "7") { // bulk load / dump a table as csv
+                string table, path;
+                cout << "\n- - Enter the table (stock or cash) and the csv file\n> ";
+                (cin >> table) >> path;
+
+                int rows = -1;
+                if (inpt == "6") {
+                    ifstream file(path);
+                    if (file) rows = Import(table, file);
                 } else {
-                    cout << "- - Change box table hasn't been created yet." << endl;
+                    ofstream file(path);
+                    if (file) rows = Export(table, file);
                 }
-                if (GetRowCount("collection_box") > 0) {
-                    cout << "\n- - Collection box information: " << endl;
-                    PrintTable("collection_box");
+                if (rows < 0) cout << "- - Cannot use table " << table << " with file " << path << endl;
+                else cout << "- - " << rows << " rows " << (inpt == "6" ? "imported" : "exported") << "!" << endl;
+            } else if (inpt == "8") { // counters and latency histograms of this process
+                cout << "\n- - Metrics" << endl;
+                Metrics::Global().WritePrometheus(cout);
+            } else if (inpt == "9") { // what to bring on the next visit, from the sales history
+                MachinePlan plan = Plan();
+                cout << "\n- - Restock plan for the next " << config.plan_horizon_days << " days, from " << plan.days_observed << " days of sales" << endl;
+                if (plan.items.empty()) {
+                    cout << "- - No item runs out before the next visit." << endl;
                 } else {
-                    cout << "- - Collection box table hasn't been created yet." << endl;
+                    cout << left << setw(8) << "ID" << setw(20) << "Name" << setw(8) << "Left" << setw(10) << "Per day" << setw(11) << "Days left" << "Restock" << endl;
+                    for (const ItemPlan& item : plan.items) {
+                        cout << setw(8) << item.id << setw(20) << item.name << setw(8) << item.amount << fixed << setprecision(1)
+                             << setw(10) << item.sold_per_day << setw(11) << item.days_left << item.restock << endl;
+                    }
                 }
-            } else if (inpt == "4") { // collect money from collection box (worked)
-                int sum = EmptyCollection();
-                cout << "\n- - You've collected " + to_string(sum) + " Baht!" << endl;
-            } else if (inpt == "5") { // refill change box (worked)
-                vector<int> amount_of_notes;
+                cout << "\n- - Refill the change box with" << endl;
                 for (int i = 0; i < bank_note.size(); i++) {
-                    string temp;
-                    cout << "\n- - Enter an amount of " + to_string(bank_note[i]) + " Baht\n> ";
-                    cin >> temp;
-                    amount_of_notes.push_back(stoi(temp));
+                    cout << bank_note[i] << " " << Currency::unit << ": " << plan.change_refill[i] << endl;
                 }
-                SetChangeBox(amount_of_notes[0], amount_of_notes[1], amount_of_notes[2], amount_of_notes[3], amount_of_notes[4]);
+                if (plan.days_to_collection >= 0) cout << "\n- - The collection box is full in " << fixed << setprecision(1) << plan.days_to_collection << " days" << endl;
+                cout.unsetf(ios::fixed);
+                cout << right;
             } else { // quit (worked)
                 cout << "- - Have a good day, sir!" << endl;
                 break;
@@ -429,18 +1847,602 @@ public:
     }
 };
 
-int main() {
-    VendingMachine vm;
-    string user;
+class ThreadPool { // fixed set of worker threads draining one task queue
+private:
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex tasks_lock;
+    condition_variable tasks_ready;
+    bool is_stopping = false;
 
-    cout << "- - Welcome to the vending machine\n- - Type 'user' to start purchasing items\n- - Type 'admin' to enter admin mode\n> ";
-    cin >> user;
- 
-    if (user == "admin") {
-        vm.AdminMode();
-    } else {
-        vm.UserMode();
+    void Work() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(tasks_lock);
+                tasks_ready.wait(lock, [this] { return is_stopping || !tasks.empty(); });
+                if (tasks.empty()) return; // stopping and nothing left to run
+                task = move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
     }
 
+public:
+    ThreadPool(int thread_count) {
+        for (int i = 0; i < max(thread_count, 1); i++) {
+            workers.emplace_back([this] { Work(); });
+        }
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool() { // finish every queued task, then join
+        {
+            lock_guard<mutex> lock(tasks_lock);
+            is_stopping = true;
+        }
+        tasks_ready.notify_all();
+        for (thread& worker : workers) worker.join();
+    }
+    future<void> Submit(function<void()> task) {
+        auto job = make_shared<packaged_task<void()>>(move(task));
+        future<void> done = job->get_future();
+        {
+            lock_guard<mutex> lock(tasks_lock);
+            tasks.push([job] { (*job)(); });
+        }
+        tasks_ready.notify_one();
+        return done;
+    }
+};
+
+class VendingFleet { // many machines in one process, each with its own tables and connection on a shared database
+private:
+    vector<unique_ptr<VendingMachine>> machines;
+    vector<unique_ptr<mutex>> machine_locks; // one lock per machine, sessions on different machines never wait on each other
+    vector<unique_ptr<atomic<bool>>> flush_queued; // a flush of that machine is waiting on the pool
+    ThreadPool pool;                         // declared last so workers are joined before the machines are destroyed
+
+    void ScheduleFlush(const int machine) { // write the machine's pending units to sqlite on the pool, at most one queued per machine
+        if (flush_queued[machine]->exchange(true)) return;
+        pool.Submit([this, machine] {
+            lock_guard<mutex> lock(*machine_locks[machine]);
+            flush_queued[machine]->store(false);
+            machines[machine]->FlushIfDue();
+        });
+    }
+
+public:
+    VendingFleet(const vector<string>& machine_names, const MachineConfig& base_config = MachineConfig(),
+                 const int thread_count = thread::hardware_concurrency()) : pool(thread_count) {
+        for (const string& name : machine_names) {
+            MachineConfig config = base_config;
+            config.machine_name = name;
+            config.background_flush = true; // sessions answer once the journal has the sale, sqlite follows on the pool
+            machines.push_back(make_unique<VendingMachine>(config));
+            machine_locks.push_back(make_unique<mutex>());
+            flush_queued.push_back(make_unique<atomic<bool>>(false));
+        }
+    }
+    int Size() const { return machines.size(); }
+    int Find(const string& machine_name) const { // index of the machine, -1 if the fleet has no such machine
+        for (int i = 0; i < machines.size(); i++) {
+            if (machines[i]->GetName() == machine_name) return i;
+        }
+        return -1;
+    }
+    future<void> Submit(const int machine, function<void(VendingMachine&)> session) { // run session on the pool while holding that machine's lock
+        return pool.Submit([this, machine, session = move(session)] {
+            lock_guard<mutex> lock(*machine_locks[machine]);
+            session(*machines[machine]);
+            machines[machine]->FlushIfDue(); // already on the pool, nothing waits on this one
+        });
+    }
+    template <class Operation>
+    auto Run(const int machine, Operation operation) { // run operation on the calling thread while holding that machine's lock, its sqlite write follows on the pool
+        lock_guard<mutex> lock(*machine_locks[machine]);
+        auto result = operation(*machines[machine]);
+        if (machines[machine]->IsFlushDue()) ScheduleFlush(machine);
+        return result;
+    }
+};
+
+class CommandSession { // one client of the line protocol, remembers its machine and sale in progress between commands
+private:
+    VendingFleet& fleet;
+    int machine = 0;
+    VendingMachine::Sale sale;
+    vector<string_view> words;
+    CashBox notes;
+    CashBox change;
+    vector<RestockEntry> restock_entries;
+
+    void Split(string_view line) { // split on spaces and tabs without copying
+        words.clear();
+        size_t start = line.find_first_not_of(" \t\r");
+        while (start != string_view::npos) {
+            size_t end = line.find_first_of(" \t\r", start);
+            words.push_back(line.substr(start, end == string_view::npos ? string_view::npos : end - start));
+            start = line.find_first_not_of(" \t\r", end);
+        }
+    }
+    static bool ParseInt(string_view word, int& value) {
+        auto result = from_chars(word.data(), word.data() + word.size(), value);
+        return result.ec == errc() && result.ptr == word.data() + word.size();
+    }
+    bool ParseNotes(const int first) { // read one count per bank note from words[first...], largest note first
+        notes = CashBox();
+        if (words.size() != first + NOTE_COUNT) return false;
+        for (int i = 0; i < NOTE_COUNT; i++) {
+            if (!ParseInt(words[first + i], notes[i]) || notes[i] < 0 || notes[i] > MAX_COUNT) return false;
+        }
+        return true;
+    }
+    static string JoinNotes(const CashBox& values, string reply = "OK") {
+        for (int n : values.notes) reply += " " + to_string(n);
+        return reply;
+    }
+    string SaleReply(const SaleResult result) { // reply to a sale event; a refused sale returns the escrow after the reason
+        switch (result) {
+            case SOLD: return JoinNotes(change);
+            case NOT_ENOUGH_PAYMENT: return "OK due " + to_string(sale.Due() / MINOR_PER_UNIT);
+            case NO_SUCH_ITEM: return JoinNotes(change, "ERR no-such-item");
+            case OUT_OF_STOCK: return JoinNotes(change, "ERR out-of-stock");
+            case INVALID_NOTE: return "ERR bad-arguments";
+            case NO_ITEM_SELECTED: return "ERR no-item-selected";
+            default: return JoinNotes(change, "ERR no-change");
+        }
+    }
+
+public:
+    CommandSession(VendingFleet& vending_fleet) : fleet(vending_fleet) {}
+
+    bool IsQuit(const string& line) {
+        Split(line);
+        return words.size() == 1 && words[0] == "quit";
+    }
+    string Execute(const string& line) { // run one command and return its reply, empty for blank lines and # comments
+        Split(line);
+        if (words.empty() || words[0][0] == '#') return "";
+        const string_view command = words[0];
+
+        if (command == "use") { // use <machine>
+            if (words.size() != 2) return "ERR bad-arguments";
+            int index = fleet.Find(string(words[1]));
+            if (index < 0) return "ERR no-such-machine";
+            if (sale.HasEscrow()) return "ERR sale-in-progress";
+            machine = index;
+            sale.Cancel();
+            return "OK";
+        }
+        if (command == "buy") { // buy <id>, replies with the price to pay, or completes the sale if the escrow covers it
+            int id;
+            if (words.size() != 2 || !ParseInt(words[1], id)) return "ERR bad-arguments";
+            return fleet.Run(machine, [&](VendingMachine& vm) -> string {
+                const SaleResult result = sale.Select(vm, id, change);
+                if (result == NO_SUCH_ITEM) return "ERR no-such-item"; // the escrow stays for another choice
+                if (result == OUT_OF_STOCK) return "ERR out-of-stock";
+                if (result == NOT_ENOUGH_PAYMENT && !sale.HasEscrow()) return "OK " + to_string(sale.Due() / MINOR_PER_UNIT);
+                return SaleReply(result);
+            });
+        }
+        if (command == "insert") { // insert <note> [count], one insertion event, replies with what is still due or the change once sold
+            int note, count = 1;
+            if (words.size() < 2 || words.size() > 3 || !ParseInt(words[1], note) || (words.size() == 3 && !ParseInt(words[2], count))) return "ERR bad-arguments";
+            return fleet.Run(machine, [&](VendingMachine& vm) { return SaleReply(sale.InsertNote(vm, note, count, change)); });
+        }
+        if (command == "pay") { // pay <note counts...>, the whole payment at once: completes the selected purchase or keeps nothing
+            return fleet.Run(machine, [&](VendingMachine& vm) -> string {
+                if (!ParseNotes(1)) return "ERR bad-arguments";
+                const SaleResult result = sale.Insert(vm, notes, change, true);
+                if (result == NOT_ENOUGH_PAYMENT) return "ERR not-enough-payment";
+                return SaleReply(result);
+            });
+        }
+        if (command == "cancel") { // cancel, replies with the refunded note counts
+            if (words.size() != 1) return "ERR bad-arguments";
+            return fleet.Run(machine, [&](VendingMachine&) { return JoinNotes(sale.Cancel()); });
+        }
+        if (command == "restock") { // restock <name> <price> <amount> [<name> <price> <amount> ...], all in one commit
+            if (words.size() < 4 || words.size() % 3 != 1) return "ERR bad-arguments";
+            restock_entries.resize((words.size() - 1) / 3);
+            for (int i = 0; i < restock_entries.size(); i++) {
+                RestockEntry& entry = restock_entries[i];
+                entry.name = words[1 + i * 3];
+                if (!ParseInt(words[2 + i * 3], entry.price) || !ParseInt(words[3 + i * 3], entry.amount) ||
+                    !VendingMachine::IsValidStock(entry.price, entry.amount)) return "ERR bad-arguments";
+                entry.price *= MINOR_PER_UNIT;
+            }
+            return fleet.Run(machine, [&](VendingMachine& vm) -> string {
+                vm.Restock(restock_entries);
+                return "OK";
+            });
+        }
+        if (command == "import" || command == "export") { // import|export <stock|cash> <csv file>, replies with the row count
+            if (words.size() != 3) return "ERR bad-arguments";
+            string table(words[1]), path(words[2]);
+            if (table != "stock" && table != "cash") return "ERR bad-arguments";
+            return fleet.Run(machine, [&](VendingMachine& vm) -> string {
+                int rows;
+                if (command == "import") {
+                    ifstream file(path);
+                    if (!file) return "ERR cannot-open-file";
+                    rows = vm.Import(table, file);
+                } else {
+                    ofstream file(path);
+                    if (!file) return "ERR cannot-open-file";
+                    rows = vm.Export(table, file);
+                }
+                return "OK " + to_string(rows);
+            });
+        }
+        if (command == "refill") { // refill <note counts...>
+            return fleet.Run(machine, [&](VendingMachine& vm) -> string {
+                if (!ParseNotes(1)) return "ERR bad-arguments";
+                vm.Refill(notes);
+                return "OK";
+            });
+        }
+        if (command == "collect") { // collect, replies with the amount collected
+            if (words.size() != 1) return "ERR bad-arguments";
+            return fleet.Run(machine, [](VendingMachine& vm) { return "OK " + to_string(vm.Collect()); });
+        }
+        if (command == "ready") { // ready, replies 1 if the machine serves customers
+            if (words.size() != 1) return "ERR bad-arguments";
+            return fleet.Run(machine, [](VendingMachine& vm) { return string(vm.IsReady() ? "OK 1" : "OK 0"); });
+        }
+        if (command == "metrics") { // metrics, replies with every counter of the process as one line of json
+            if (words.size() != 1) return "ERR bad-arguments";
+            ostringstream json;
+            Metrics::Global().WriteJson(json);
+            return "OK " + json.str();
+        }
+        if (command == "quit") return "OK";
+        return "ERR unknown-command";
+    }
+    void Serve(istream& in, ostream& out) { // answer every line of in until quit or end of input
+        string line;
+        while (getline(in, line)) {
+            string reply = Execute(line);
+            if (!reply.empty()) out << reply << '\n' << flush;
+            if (IsQuit(line)) break;
+        }
+    }
+};
+
+void ServeSocket(VendingFleet& fleet, const string& path) { // accept connections on a unix socket, one session thread per connection
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (server < 0 || path.size() >= sizeof(address.sun_path)) {
+        cerr << "Cannot open socket " << path << endl;
+        return;
+    }
+    path.copy(address.sun_path, path.size());
+    unlink(path.c_str());
+    if (bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(server, 64) < 0) {
+        cerr << "Cannot listen on socket " << path << endl;
+        close(server);
+        return;
+    }
+
+    struct Session {
+        thread worker;
+        shared_ptr<atomic<bool>> is_done;
+    };
+    vector<Session> sessions;
+    int client;
+    while ((client = accept(server, nullptr, nullptr)) >= 0) {
+        for (auto it = sessions.begin(); it != sessions.end();) { // join the connections that have closed since the last accept
+            if (it->is_done->load()) {
+                it->worker.join();
+                it = sessions.erase(it);
+            } else {
+                it++;
+            }
+        }
+        auto is_done = make_shared<atomic<bool>>(false);
+        thread worker([&fleet, client, is_done] {
+            CommandSession session(fleet);
+            string pending, replies;
+            char buffer[4096];
+            ssize_t received;
+            bool is_quit = false;
+
+            while (!is_quit && (received = read(client, buffer, sizeof(buffer))) > 0) {
+                pending.append(buffer, received);
+                size_t start = 0, end;
+                while (!is_quit && (end = pending.find('\n', start)) != string::npos) {
+                    string line = pending.substr(start, end - start);
+                    string reply = session.Execute(line);
+                    if (!reply.empty()) replies += reply + '\n';
+                    is_quit = session.IsQuit(line);
+                    start = end + 1;
+                }
+                pending.erase(0, start);
+                if (!replies.empty() && write(client, replies.data(), replies.size()) < 0) break; // one write per batch of lines
+                replies.clear();
+            }
+            close(client);
+            is_done->store(true);
+        });
+        sessions.push_back({move(worker), is_done});
+    }
+    for (Session& session : sessions) session.worker.join();
+    close(server);
+}
+
+void WritePlanJson(ostream& out, const MachinePlan& plan) {
+    const auto& bank_note = Currency::notes;
+    auto quote = [](const string& text) {
+        string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            quoted += c;
+        }
+        return quoted + '"';
+    };
+
+    out << "  {\"machine\": " << quote(plan.machine) << ", \"days_observed\": " << plan.days_observed
+        << ", \"days_to_collection\": " << plan.days_to_collection << ",\n   \"change_refill\": {";
+    for (int i = 0; i < bank_note.size(); i++) {
+        out << (i ? ", " : "") << '"' << bank_note[i] << "\": {\"per_day\": " << plan.change_per_day[i] << ", \"refill\": " << plan.change_refill[i] << '}';
+    }
+    out << "},\n   \"restock\": [";
+    for (int i = 0; i < plan.items.size(); i++) {
+        const ItemPlan& item = plan.items[i];
+        out << (i ? ",\n     " : "\n     ") << "{\"id\": " << item.id << ", \"name\": " << quote(item.name) << ", \"amount\": " << item.amount
+            << ", \"per_day\": " << item.sold_per_day << ", \"days_left\": " << item.days_left << ", \"restock\": " << item.restock << '}';
+    }
+    out << "]}";
+}
+
+int PlanFleet(VendingFleet& fleet, ostream& out) { // forecast every machine in parallel on the fleet's pool, the plans as json
+    vector<MachinePlan> plans(fleet.Size());
+    vector<future<void>> done;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < fleet.Size(); i++) {
+        done.push_back(fleet.Submit(i, [&plans, i](VendingMachine& vm) { plans[i] = vm.Plan(); }));
+    }
+    for (future<void>& machine_done : done) machine_done.get();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    out << "{\"seconds\": " << seconds << ", \"plans\": [\n";
+    for (int i = 0; i < plans.size(); i++) {
+        WritePlanJson(out, plans[i]);
+        out << (i + 1 < plans.size() ? ",\n" : "\n");
+    }
+    out << "]}" << endl;
+    return 0;
+}
+
+int Replay(VendingFleet& fleet, const string& path) { // push a recorded command log through one session as fast as possible and report throughput as json
+    ifstream log(path);
+    if (!log) {
+        cerr << "Cannot open " << path << endl;
+        return 1;
+    }
+
+    CommandSession session(fleet);
+    string line;
+    long long total = 0, errors = 0;
+    auto start = chrono::steady_clock::now();
+
+    while (getline(log, line)) {
+        string reply = session.Execute(line);
+        if (reply.empty()) continue;
+        total++;
+        if (reply[0] == 'E') errors++;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "{\"commands\": " << total << ", \"errors\": " << errors << ", \"seconds\": " << seconds
+         << ", \"commands_per_second\": " << (seconds > 0 ? total / seconds : 0) << "}" << endl;
+    return 0;
+}
+
+class Benchmark { // times the machine's hot paths across catalog sizes on disk and in memory, results as json
+private:
+    struct Result {
+        string name;
+        string database;
+        int catalog_size;
+        long long iterations;
+        double mean_ns, p50_ns, p99_ns;
+    };
+    vector<Result> results;
+    double min_seconds = 0.2;    // keep repeating an operation at least this long
+    long long max_iterations = 200000;
+    volatile bool outcome;       // results are stored here so the optimizer cannot drop the calls
+
+    template <class Operation>
+    void Measure(const string& name, const string& database, const int catalog_size, Operation operation) {
+        vector<long long> samples;
+        auto start = chrono::steady_clock::now();
+        auto elapsed = chrono::steady_clock::duration::zero();
+
+        for (long long i = 0; i < max_iterations && (i < 3 || elapsed < chrono::duration<double>(min_seconds)); i++) {
+            auto before = chrono::steady_clock::now();
+            operation(i);
+            auto after = chrono::steady_clock::now();
+            samples.push_back(chrono::duration_cast<chrono::nanoseconds>(after - before).count());
+            elapsed = after - start;
+        }
+        sort(samples.begin(), samples.end());
+
+        double total = 0;
+        for (long long sample : samples) total += sample;
+        results.push_back({name, database, catalog_size, (long long)samples.size(), total / samples.size(),
+                           (double)samples[samples.size() / 2], (double)samples[samples.size() * 99 / 100]});
+        cerr << "  " << left << setw(16) << name << setw(8) << database << setw(10) << catalog_size << fixed << setprecision(0) << total / samples.size() << " ns/op" << endl;
+    }
+    static void Seed(VendingMachine& vm, const int catalog_size) { // fill the catalog directly and flush it in one transaction
+        for (int i = 0; i < catalog_size; i++) {
+            vm.UpsertItem("item" + to_string(i), (10 + i % 90) * MINOR_PER_UNIT, 1 << 30); // never runs out while benchmarking
+        }
+        CashBox full;
+        full.notes.fill(1 << 20);
+        vm.SetChangeBox(full);
+        vm.Flush();
+    }
+    void RunCatalog(const string& database, const string& path, const int catalog_size) {
+        for (const char* suffix : {"", "-wal", "-shm", ".journal", ".snapshot"}) remove((path + suffix).c_str());
+
+        MachineConfig config;
+        config.database = path;
+        {
+            VendingMachine vm(config);
+            Seed(vm, catalog_size);
+
+            ostringstream sink; // PrintTable output goes here instead of the terminal
+            streambuf* terminal = cout.rdbuf(sink.rdbuf());
+
+            Measure("BuyItem", database, catalog_size, [&](long long i) { vm.BuyItem(vm.stock.Id(i % catalog_size)); });
+            vm.Flush(); // BuyItem alone never ends a unit of work, keep its writes out of the next timings
+            Measure("GiveChange", database, catalog_size, [&](long long i) {
+                CashBox change, delta;
+                delta[NOTE_COUNT - 1] = i % 2 ? 1 : -1;
+                vm.SetChangeBox(delta); // a sale always changes the box, so never hit the cached tables
+                outcome = vm.GiveChange(13 * MINOR_PER_UNIT, 100 * MINOR_PER_UNIT, change);
+            });
+            Measure("RestockItem", database, catalog_size, [&](long long i) { vm.RestockItem("item" + to_string(i % catalog_size), 50 * MINOR_PER_UNIT, 1); });
+            Measure("CheckOutOfStock", database, catalog_size, [&](long long) { outcome = vm.CheckOutOfStock(); });
+            Measure("PrintTable", database, catalog_size, [&](long long) {
+                vm.PrintTable("stocks_67011140");
+                sink.str("");
+            });
+            CashBox paid; // enough of the largest note for the 100 unit seed price
+            paid[0] = (100 + Currency::notes[0] - 1) / Currency::notes[0];
+            Measure("Sale", database, catalog_size, [&](long long i) {
+                CashBox change;
+                outcome = vm.IsReady();
+                vm.SellItem(vm.stock.Id(i % catalog_size), paid, change);
+            });
+
+            cout.rdbuf(terminal);
+        }
+        for (const char* suffix : {"", "-wal", "-shm", ".journal", ".snapshot"}) remove((path + suffix).c_str());
+    }
+
+public:
+    int Run(const int max_catalog_size, ostream& out) {
+        for (int catalog_size = 10; catalog_size <= max_catalog_size; catalog_size *= 10) {
+            RunCatalog("memory", ":memory:", catalog_size);
+            RunCatalog("disk", "VendingMachineBenchmark.db", catalog_size);
+        }
+
+        out << "{\"benchmarks\": [";
+        for (int i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            out << (i ? "," : "") << "\n  {\"name\": \"" << r.name << "\", \"database\": \"" << r.database
+                << "\", \"catalog_size\": " << r.catalog_size << ", \"iterations\": " << r.iterations
+                << fixed << setprecision(1) << ", \"mean_ns\": " << r.mean_ns << ", \"p50_ns\": " << r.p50_ns
+                << ", \"p99_ns\": " << r.p99_ns << ", \"ops_per_second\": " << 1e9 / r.mean_ns << "}";
+        }
+        out << "\n]}" << endl;
+        return 0;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    MachineConfig config;
+    vector<string> machine_names;
+    string mode, target;
+    int bench_max = 1000000;
+    auto parse_number = [](const string& text, int& number, const int minimum) { // false leaves number alone and prints the usage
+        int parsed = 0;
+        auto result = from_chars(text.data(), text.data() + text.size(), parsed);
+        if (result.ec != errc() || result.ptr != text.data() + text.size() || parsed < minimum) return false;
+        number = parsed;
+        return true;
+    };
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+
+        if (arg == "--protocol" || arg == "--bench" || arg == "--plan") {
+            mode = arg;
+        } else if (arg == "--bench-max" && i + 1 < argc && parse_number(value, bench_max, 1)) { // largest catalog size to benchmark
+            i++;
+        } else if ((arg == "--script" || arg == "--socket" || arg == "--replay") && i + 1 < argc) {
+            mode = arg;
+            target = value;
+            i++;
+        } else if (arg == "--db" && i + 1 < argc) {
+            config.database = value;
+            i++;
+        } else if (arg == "--machines" && i + 1 < argc) { // comma separated machine names
+            for (size_t start = 0, end; start <= value.size(); start = end + 1) {
+                end = value.find(',', start);
+                if (end == string::npos) end = value.size();
+                machine_names.push_back(value.substr(start, end - start));
+            }
+            i++;
+        } else if (arg == "--commit" && i + 1 < argc && parse_number(value, config.sales_per_commit, 1)) {
+            i++;
+        } else if ((arg == "--journal-mode" || arg == "--synchronous") && i + 1 < argc) { // sqlite durability, checked by the machine
+            transform(value.begin(), value.end(), value.begin(), ::toupper);
+            (arg == "--journal-mode" ? config.journal_mode : config.synchronous) = value;
+            i++;
+        } else if (arg == "--max-collection" && i + 1 < argc && parse_number(value, config.max_collection, 1)) {
+            i++;
+        } else if (arg == "--min-change" && i + 1 < argc && parse_number(value, config.min_change, 0)) {
+            i++;
+        } else if (arg == "--horizon" && i + 1 < argc && parse_number(value, config.plan_horizon_days, 0)) { // days until the next visit, for --plan and the admin plan
+            i++;
+        } else {
+            cerr << "Usage: " << argv[0] << " [--protocol | --script file | --socket path | --replay file | --plan | --bench [--bench-max n]] [--db file] [--machines a,b,...] [--commit n] [--journal-mode mode] [--synchronous level] [--max-collection n] [--min-change n] [--horizon days]" << endl;
+            return 1;
+        }
+    }
+
+    try { // the machines throw when their database cannot be opened or set up
+        if (mode == "--bench") { // json goes to stdout, progress to stderr
+            Benchmark benchmark;
+            return benchmark.Run(bench_max, cout);
+        }
+        if (!mode.empty()) { // non-interactive: serve the command protocol over the fleet
+            if (machine_names.empty()) machine_names.push_back(config.machine_name);
+            VendingFleet fleet(machine_names, config);
+
+            if (mode == "--replay") return Replay(fleet, target);
+            if (mode == "--plan") return PlanFleet(fleet, cout);
+            if (mode == "--socket") {
+                ServeSocket(fleet, target);
+                return 0;
+            }
+            CommandSession session(fleet);
+            if (mode == "--script") {
+                ifstream script(target);
+                if (!script) {
+                    cerr << "Cannot open " << target << endl;
+                    return 1;
+                }
+                session.Serve(script, cout);
+            } else {
+                session.Serve(cin, cout);
+            }
+            return 0;
+        }
+
+        if (!machine_names.empty()) config.machine_name = machine_names[0];
+        VendingMachine vm(config);
+        string user;
+
+        cout << "- - Welcome to the vending machine\n- - Type 'user' to start purchasing items\n- - Type 'admin' to enter admin mode\n> ";
+        cin >> user;
+ 
+        if (user == "admin") {
+            vm.AdminMode();
+        } else {
+            vm.UserMode();
+        }
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file